@@ -0,0 +1,138 @@
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "dd_arena.h"
+
+#define ARENA_ALIGN 16
+#define MAX_ALIGN 4096
+#define ALIGN_UP(n, a) (((n) + (a) - 1) & ~(uintptr_t)((a) - 1))
+
+// 在每个chunk的开头
+struct dd_arena_chunk_t
+{
+    struct dd_arena_chunk_t *next;
+    size_t size;
+};
+
+// 在第一个chunk中,chunk头之后
+struct dd_arena_t
+{
+    struct dd_arena_chunk_t *chunks;
+    char *cur;
+    char *end;
+    size_t chunk_size;
+    size_t size;
+};
+
+static struct dd_arena_chunk_t *chunk_new(size_t size)
+{
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    struct dd_arena_chunk_t *chunk = (struct dd_arena_chunk_t *)p;
+    chunk->next = NULL;
+    chunk->size = size;
+
+    return chunk;
+}
+
+struct dd_arena_t *dd_arena_new(size_t chunk_size)
+{
+    if (chunk_size == 0)
+        chunk_size = DD_ARENA_CHUNK;
+    chunk_size = ALIGN_UP(chunk_size, MAX_ALIGN);
+
+    struct dd_arena_chunk_t *chunk = chunk_new(chunk_size);
+    if (chunk == NULL)
+        return NULL;
+
+    struct dd_arena_t *arena = (struct dd_arena_t *)(chunk + 1);
+    arena->chunks = chunk;
+    arena->cur = (char *)ALIGN_UP((uintptr_t)(arena + 1), ARENA_ALIGN);
+    arena->end = (char *)chunk + chunk_size;
+    arena->chunk_size = chunk_size;
+    arena->size = chunk_size;
+
+    return arena;
+}
+
+// arena本身也在其中一个chunk中,释放chunk之前先取出next
+void dd_arena_free(struct dd_arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    struct dd_arena_chunk_t *chunk = arena->chunks;
+    while (chunk != NULL)
+    {
+        struct dd_arena_chunk_t *next = chunk->next;
+        munmap(chunk, chunk->size);
+        chunk = next;
+    }
+}
+
+void *dd_arena_memalign(struct dd_arena_t *arena, size_t size, size_t align)
+{
+    if (align == 0)
+        align = 1;
+    if (align > MAX_ALIGN || (align & (align - 1)) != 0)
+        return NULL;
+
+    char *p = (char *)ALIGN_UP((uintptr_t)arena->cur, align);
+    if (p <= arena->end && size <= (size_t)(arena->end - p))
+    {
+        arena->cur = p + size;
+        return p;
+    }
+
+    // 大的分配单独使用一个chunk,插在当前chunk之后,当前chunk剩下的空间还可以继续使用
+    size_t head = ALIGN_UP(sizeof (struct dd_arena_chunk_t), align);
+    if (size > arena->chunk_size / 4)
+    {
+        if (size > SIZE_MAX - head - MAX_ALIGN)
+            return NULL;
+        struct dd_arena_chunk_t *chunk = chunk_new(ALIGN_UP(head + size, MAX_ALIGN));
+        if (chunk == NULL)
+            return NULL;
+        chunk->next = arena->chunks->next;
+        arena->chunks->next = chunk;
+        arena->size += chunk->size;
+        return (char *)chunk + head;
+    }
+
+    struct dd_arena_chunk_t *chunk = chunk_new(arena->chunk_size);
+    if (chunk == NULL)
+        return NULL;
+    chunk->next = arena->chunks;
+    arena->chunks = chunk;
+    arena->size += chunk->size;
+    p = (char *)chunk + head;
+    arena->cur = p + size;
+    arena->end = (char *)chunk + chunk->size;
+
+    return p;
+}
+
+void *dd_arena_alloc(struct dd_arena_t *arena, size_t size)
+{
+    return dd_arena_memalign(arena, size, ARENA_ALIGN);
+}
+
+char *dd_arena_strndup(struct dd_arena_t *arena, const char *s, size_t len)
+{
+    char *p = (char *)dd_arena_memalign(arena, len + 1, 1);
+    if (p == NULL)
+        return NULL;
+
+    memcpy(p, s, len);
+    p[len] = '\0';
+
+    return p;
+}
+
+size_t dd_arena_size(const struct dd_arena_t *arena)
+{
+    return arena->size;
+}
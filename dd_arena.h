@@ -0,0 +1,39 @@
+#ifndef _DD_ARENA_H
+#define _DD_ARENA_H
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 一个版本的内存,从大块(chunk)中顺序分配,不能单独释放
+// 版本退休时一起释放,代价只和chunk数有关,不同版本之间不会互相产生碎片
+// chunk直接mmap,释放后归还给系统
+// 不是线程安全的,只在ini_fun中使用
+
+// 默认的chunk大小
+#define DD_ARENA_CHUNK (2 << 20)
+
+struct dd_arena_t;
+
+// chunk_size为0时使用DD_ARENA_CHUNK
+struct dd_arena_t *dd_arena_new(size_t chunk_size);
+void dd_arena_free(struct dd_arena_t *arena);
+
+// 按16字节对齐,失败返回NULL
+// 大于chunk_size/4的分配单独使用一个chunk
+void *dd_arena_alloc(struct dd_arena_t *arena, size_t size);
+// align必须是2的幂,不超过4096
+// dd_arena_strndup不对齐
+void *dd_arena_memalign(struct dd_arena_t *arena, size_t size, size_t align);
+char *dd_arena_strndup(struct dd_arena_t *arena, const char *s, size_t len);
+
+// 已经映射的大小
+size_t dd_arena_size(const struct dd_arena_t *arena);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,564 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dyndict_manager.h"
+#include "dd_image.h"
+
+#define ALIGN8(n) (((n) + 7) & ~(uint64_t)7)
+
+// 平均每个disp对应的key数
+#define MPH_GROUP_SIZE 4
+// 只有一个key的disp直接保存bucket下标
+#define MPH_DIRECT 0x80000000u
+// 每个disp尝试的次数,失败后换seed重新开始
+#define MPH_MAX_DISP (1u << 16)
+#define MPH_MAX_SEED 16
+
+struct dd_image_t
+{
+    const char *base;
+    size_t size;
+    const struct dd_image_header_t *header;
+    const uint32_t *disps;
+    const uint64_t *buckets;
+};
+
+// 每次8字节,和ddm_finger_file_hash相同的混合
+// 写入文件的hash,修改会使已有的文件失效
+static uint64_t image_hash(const char *key, size_t len, uint64_t seed)
+{
+    uint64_t h = seed ^ (len * 0x9E3779B97F4A7C15ull);
+    while (len >= sizeof (uint64_t))
+    {
+        uint64_t v;
+        memcpy(&v, key, sizeof (v));
+        h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        key += sizeof (v);
+        len -= sizeof (v);
+    }
+    if (len > 0)
+    {
+        uint64_t v = 0;
+        memcpy(&v, key, len);
+        h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ull;
+
+    return h ^ (h >> 32);
+}
+
+// 把x均匀映射到[0, n),比取模快
+static uint32_t fast_range(uint32_t x, uint32_t n)
+{
+    return (uint32_t)(((uint64_t)x * n) >> 32);
+}
+
+static uint32_t mph_bucket(uint64_t h, uint32_t disp, uint32_t num)
+{
+    if (disp & MPH_DIRECT)
+        return disp & ~MPH_DIRECT;
+
+    h = (h ^ ((uint64_t)(disp + 1) * 0x9E3779B97F4A7C15ull)) * 0xBF58476D1CE4E5B9ull;
+    h ^= h >> 31;
+
+    return fast_range((uint32_t)h, num);
+}
+
+static uint64_t image_checksum(const char *base, size_t size)
+{
+    const uint64_t *words = (const uint64_t *)base;
+    size_t skip = offsetof(struct dd_image_header_t, checksum) / sizeof (uint64_t);
+    uint64_t h = size;
+    size_t i;
+    for (i = 0; i < size / sizeof (uint64_t); i++)
+    {
+        h = (h ^ (i == skip ? 0 : words[i])) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+
+    return h;
+}
+
+static int check_header(const struct dd_image_header_t *header, size_t size)
+{
+    if (size < sizeof (*header)
+            || header->magic != DD_IMAGE_MAGIC
+            || header->version != DD_IMAGE_VERSION
+            || header->size != size)
+        return -1;
+
+    uint32_t n = header->bucket_num;
+    if (header->flags & DD_IMAGE_MPH)
+    {
+        if (n != header->num || n >= MPH_DIRECT || (n > 0 && header->disp_num == 0)
+                || header->disp_off < sizeof (*header) || header->disp_off % sizeof (uint32_t) != 0
+                || header->disp_off + (uint64_t)header->disp_num * sizeof (uint32_t) > size)
+            return -1;
+    }
+    else if (n == 0 || (n & (n - 1)) != 0 || header->num >= n)
+        return -1;
+    if (header->bucket_off < sizeof (*header) || header->bucket_off % sizeof (uint64_t) != 0
+            || header->bucket_off + (uint64_t)n * sizeof (uint64_t) > size
+            || header->data_off > size)
+        return -1;
+
+    return 0;
+}
+
+static void image_set(struct dd_image_t *image, const char *base, size_t size)
+{
+    image->base = base;
+    image->size = size;
+    image->header = (const struct dd_image_header_t *)base;
+    image->disps = (const uint32_t *)(base + image->header->disp_off);
+    image->buckets = (const uint64_t *)(base + image->header->bucket_off);
+}
+
+void *dd_image_ini(void *path)
+{
+    int fd = open((const char *)path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof (struct dd_image_header_t))
+    {
+        close(fd);
+        return NULL;
+    }
+
+    // 映射之后文件描述符就不需要了
+    void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return NULL;
+
+    struct dd_image_t *image = (struct dd_image_t *)malloc(sizeof (struct dd_image_t));
+    if (image == NULL || check_header((const struct dd_image_header_t *)base, st.st_size) != 0)
+    {
+        free(image);
+        munmap(base, st.st_size);
+        return NULL;
+    }
+
+    image_set(image, (const char *)base, st.st_size);
+
+    return image;
+}
+
+void dd_image_fini(void *args)
+{
+    struct dd_image_t *image = (struct dd_image_t *)args;
+    if (image == NULL)
+        return;
+
+    munmap((void *)image->base, image->size);
+    free(image);
+}
+
+size_t dd_image_size(void *args)
+{
+    return ((struct dd_image_t *)args)->size;
+}
+
+uint32_t dd_image_num(const struct dd_image_t *image)
+{
+    return image->header->num;
+}
+
+// 偏移来自文件,使用之前检查边界
+static const struct dd_image_entry_t *image_entry(const struct dd_image_t *image, uint64_t off)
+{
+    if (off < image->header->data_off || off % sizeof (uint64_t) != 0
+            || off + sizeof (struct dd_image_entry_t) > image->size)
+        return NULL;
+
+    const struct dd_image_entry_t *entry = (const struct dd_image_entry_t *)(image->base + off);
+    if (off + sizeof (*entry) + (uint64_t)entry->klen + entry->vlen + 2 > image->size)
+        return NULL;
+
+    return entry;
+}
+
+static int entry_match(const struct dd_image_entry_t *entry, uint64_t h, const char *key, size_t klen, const char **val, size_t *vlen)
+{
+    const char *k = (const char *)(entry + 1);
+    if (entry->hash != (uint32_t)(h >> 32) || entry->klen != klen || memcmp(k, key, klen) != 0)
+        return 0;
+
+    *val = k + klen + 1;
+    if (vlen != NULL)
+        *vlen = entry->vlen;
+
+    return 1;
+}
+
+int dd_image_get(const struct dd_image_t *image, const char *key, size_t klen, const char **val, size_t *vlen)
+{
+    const struct dd_image_header_t *header = image->header;
+    uint64_t h = image_hash(key, klen, header->seed);
+    const struct dd_image_entry_t *entry;
+
+    // 不在文件中的key也会得到一个bucket,需要比较key
+    if (header->flags & DD_IMAGE_MPH)
+    {
+        if (header->num == 0)
+            return DDM_NODICT;
+        uint32_t disp = image->disps[fast_range((uint32_t)(h >> 32), header->disp_num)];
+        uint32_t b = mph_bucket(h, disp, header->num);
+        if (b >= header->num || (entry = image_entry(image, image->buckets[b])) == NULL)
+            return DDM_NODICT;
+
+        return entry_match(entry, h, key, klen, val, vlen) ? DDM_OK : DDM_NODICT;
+    }
+
+    uint32_t mask = header->bucket_num - 1;
+    uint32_t i;
+    for (i = (uint32_t)h & mask; image->buckets[i] != 0; i = (i + 1) & mask)
+    {
+        if ((entry = image_entry(image, image->buckets[i])) == NULL)
+            return DDM_NODICT;
+        if (entry_match(entry, h, key, klen, val, vlen))
+            return DDM_OK;
+    }
+
+    return DDM_NODICT;
+}
+
+int dd_image_verify(const char *path, uint32_t *num)
+{
+    struct dd_image_t *image = (struct dd_image_t *)dd_image_ini((void *)path);
+    if (image == NULL)
+        return DDM_NODICT;
+
+    int ret = DDM_OK;
+    if (image_checksum(image->base, image->size) != image->header->checksum)
+        ret = DDM_UNKNOWN;
+
+    // 每个bucket都要指向合法的entry
+    uint32_t i;
+    uint32_t found = 0;
+    for (i = 0; ret == DDM_OK && i < image->header->bucket_num; i++)
+    {
+        if (image->buckets[i] == 0)
+            continue;
+        if (image_entry(image, image->buckets[i]) == NULL)
+            ret = DDM_UNKNOWN;
+        found++;
+    }
+    if (ret == DDM_OK && found != image->header->num)
+        ret = DDM_UNKNOWN;
+    if (ret == DDM_OK && num != NULL)
+        *num = found;
+
+    dd_image_fini(image);
+
+    return ret;
+}
+
+static int write_all(int fd, const char *buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t n = write(fd, buf, size);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+// 写完fsync之后再rename,替换不会被看到一半的文件
+static int write_file(const char *path, const char *buf, size_t size)
+{
+    char tmp[4096];
+    if (snprintf(tmp, sizeof (tmp), "%s.tmp", path) >= (int)sizeof (tmp))
+        return DDM_OVERFLOW;
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return DDM_UNKNOWN;
+
+    if (write_all(fd, buf, size) != 0 || fsync(fd) != 0)
+    {
+        close(fd);
+        unlink(tmp);
+        return DDM_UNKNOWN;
+    }
+    close(fd);
+
+    if (rename(tmp, path) != 0)
+    {
+        unlink(tmp);
+        return DDM_UNKNOWN;
+    }
+
+    return DDM_OK;
+}
+
+// 线性探测,装载率不超过1/2
+static int build_buckets(char *buf, const struct dd_image_kv_t *kvs, const uint64_t *offs)
+{
+    struct dd_image_header_t *header = (struct dd_image_header_t *)buf;
+    struct dd_image_t image;
+    image_set(&image, buf, header->size);
+    uint64_t *buckets = (uint64_t *)(buf + header->bucket_off);
+    uint32_t mask = header->bucket_num - 1;
+
+    uint32_t i;
+    for (i = 0; i < header->num; i++)
+    {
+        const char *val;
+        if (dd_image_get(&image, kvs[i].key, kvs[i].klen, &val, NULL) == DDM_OK)
+            return DDM_DUP;
+
+        uint32_t b = (uint32_t)image_hash(kvs[i].key, kvs[i].klen, header->seed) & mask;
+        while (buckets[b] != 0)
+            b = (b + 1) & mask;
+        buckets[b] = offs[i];
+    }
+
+    return DDM_OK;
+}
+
+// hash-and-displace:key按hash分到disp_num组,从大到小为每组找一个disp,
+// 使组内的key都落在空的bucket上;只有一个key的组最后直接填入剩下的bucket
+// 返回1表示这个seed找不到disp
+static int try_mph(char *buf, const struct dd_image_kv_t *kvs, const uint64_t *offs, uint64_t *hashes, uint32_t *order, uint32_t *start, uint32_t *groups)
+{
+    struct dd_image_header_t *header = (struct dd_image_header_t *)buf;
+    uint32_t num = header->num;
+    uint32_t disp_num = header->disp_num;
+    uint32_t *disps = (uint32_t *)(buf + header->disp_off);
+    uint64_t *buckets = (uint64_t *)(buf + header->bucket_off);
+    memset(disps, 0, disp_num * sizeof (uint32_t));
+    memset(buckets, 0, num * sizeof (uint64_t));
+
+    // 按组计数排序,order[start[g], start[g + 1])为第g组
+    uint32_t i, j, k;
+    memset(start, 0, (disp_num + 1) * sizeof (uint32_t));
+    for (i = 0; i < num; i++)
+    {
+        hashes[i] = image_hash(kvs[i].key, kvs[i].klen, header->seed);
+        start[fast_range((uint32_t)(hashes[i] >> 32), disp_num) + 1]++;
+    }
+    uint32_t max_size = 0;
+    for (i = 0; i < disp_num; i++)
+    {
+        if (start[i + 1] > max_size)
+            max_size = start[i + 1];
+        start[i + 1] += start[i];
+    }
+    for (i = 0; i < num; i++)
+    {
+        uint32_t g = fast_range((uint32_t)(hashes[i] >> 32), disp_num);
+        order[start[g]++] = i;
+    }
+    for (i = disp_num; i > 0; i--)
+        start[i] = start[i - 1];
+    start[0] = 0;
+
+    // 相同的key一定在同一组,而且hash相同
+    for (i = 0; i < disp_num; i++)
+    {
+        for (j = start[i]; j < start[i + 1]; j++)
+        {
+            for (k = start[i]; k < j; k++)
+            {
+                const struct dd_image_kv_t *a = &kvs[order[j]];
+                const struct dd_image_kv_t *b = &kvs[order[k]];
+                if (hashes[order[j]] == hashes[order[k]] && a->klen == b->klen
+                        && memcmp(a->key, b->key, a->klen) == 0)
+                    return DDM_DUP;
+            }
+        }
+    }
+
+    // 组按大小从大到小,大小相同时按下标,保证结果确定
+    uint32_t n = 0;
+    uint32_t size;
+    for (size = max_size; size >= 1; size--)
+    {
+        for (i = 0; i < disp_num; i++)
+        {
+            if (start[i + 1] - start[i] == size)
+                groups[n++] = i;
+        }
+    }
+
+    uint32_t slot[max_size > 0 ? max_size : 1];
+    uint32_t free_bucket = 0;
+    for (i = 0; i < n; i++)
+    {
+        uint32_t g = groups[i];
+        const uint32_t *members = order + start[g];
+        size = start[g + 1] - start[g];
+        if (size == 1)
+        {
+            while (buckets[free_bucket] != 0)
+                free_bucket++;
+            disps[g] = MPH_DIRECT | free_bucket;
+            buckets[free_bucket] = offs[members[0]];
+            continue;
+        }
+
+        uint32_t disp;
+        for (disp = 0; disp < MPH_MAX_DISP; disp++)
+        {
+            for (j = 0; j < size; j++)
+            {
+                slot[j] = mph_bucket(hashes[members[j]], disp, num);
+                if (buckets[slot[j]] != 0)
+                    break;
+                for (k = 0; k < j && slot[k] != slot[j]; k++)
+                    ;
+                if (k < j)
+                    break;
+            }
+            if (j == size)
+                break;
+        }
+        if (disp == MPH_MAX_DISP)
+            return 1;
+
+        disps[g] = disp;
+        for (j = 0; j < size; j++)
+            buckets[slot[j]] = offs[members[j]];
+    }
+
+    return DDM_OK;
+}
+
+static int build_mph(char *buf, const struct dd_image_kv_t *kvs, const uint64_t *offs)
+{
+    struct dd_image_header_t *header = (struct dd_image_header_t *)buf;
+    uint32_t num = header->num;
+    uint64_t *hashes = (uint64_t *)malloc(num * sizeof (uint64_t) + 1);
+    uint32_t *order = (uint32_t *)malloc(num * sizeof (uint32_t) + 1);
+    uint32_t *start = (uint32_t *)malloc((header->disp_num + 1) * sizeof (uint32_t));
+    uint32_t *groups = (uint32_t *)malloc(header->disp_num * sizeof (uint32_t) + 1);
+
+    int ret = DDM_MEM;
+    if (hashes != NULL && order != NULL && start != NULL && groups != NULL)
+    {
+        ret = DDM_OVERFLOW;
+        for (header->seed = 0; header->seed < MPH_MAX_SEED; header->seed++)
+        {
+            int r = try_mph(buf, kvs, offs, hashes, order, start, groups);
+            if (r != 1)
+            {
+                ret = r;
+                break;
+            }
+        }
+    }
+
+    free(groups);
+    free(start);
+    free(order);
+    free(hashes);
+
+    return ret;
+}
+
+int dd_image_write(const char *path, const struct dd_image_kv_t *kvs, uint32_t num, int flags)
+{
+    uint32_t bucket_num = num;
+    uint32_t disp_num = 0;
+    if (flags & DD_IMAGE_MPH)
+    {
+        if (num >= MPH_DIRECT)
+            return DDM_OVERFLOW;
+        disp_num = (num + MPH_GROUP_SIZE - 1) / MPH_GROUP_SIZE;
+    }
+    else
+    {
+        bucket_num = 1;
+        while (bucket_num < 2 * (uint64_t)num + 1)
+        {
+            if (bucket_num >= (1u << 31))
+                return DDM_OVERFLOW;
+            bucket_num <<= 1;
+        }
+    }
+
+    uint64_t disp_off = sizeof (struct dd_image_header_t);
+    uint64_t bucket_off = ALIGN8(disp_off + (uint64_t)disp_num * sizeof (uint32_t));
+    uint64_t data_off = bucket_off + (uint64_t)bucket_num * sizeof (uint64_t);
+    uint64_t size = data_off;
+    uint32_t i;
+    for (i = 0; i < num; i++)
+    {
+        if (kvs[i].klen > UINT32_MAX || kvs[i].vlen > UINT32_MAX)
+            return DDM_OVERFLOW;
+        size += ALIGN8(sizeof (struct dd_image_entry_t) + kvs[i].klen + kvs[i].vlen + 2);
+    }
+
+    char *buf = (char *)calloc(1, size);
+    uint64_t *offs = (uint64_t *)malloc(num * sizeof (uint64_t) + 1);
+    if (buf == NULL || offs == NULL)
+    {
+        free(offs);
+        free(buf);
+        return DDM_MEM;
+    }
+
+    struct dd_image_header_t *header = (struct dd_image_header_t *)buf;
+    header->magic = DD_IMAGE_MAGIC;
+    header->version = DD_IMAGE_VERSION;
+    header->flags = flags & DD_IMAGE_MPH;
+    header->num = num;
+    header->bucket_num = bucket_num;
+    header->disp_num = disp_num;
+    header->disp_off = disp_off;
+    header->bucket_off = bucket_off;
+    header->data_off = data_off;
+    header->size = size;
+
+    // entry按输入的顺序
+    uint64_t off = data_off;
+    for (i = 0; i < num; i++)
+    {
+        struct dd_image_entry_t *entry = (struct dd_image_entry_t *)(buf + off);
+        entry->hash = (uint32_t)(image_hash(kvs[i].key, kvs[i].klen, 0) >> 32);
+        entry->klen = kvs[i].klen;
+        entry->vlen = kvs[i].vlen;
+        char *k = (char *)(entry + 1);
+        memcpy(k, kvs[i].key, kvs[i].klen);
+        memcpy(k + kvs[i].klen + 1, kvs[i].val, kvs[i].vlen);
+        offs[i] = off;
+        off += ALIGN8(sizeof (*entry) + kvs[i].klen + kvs[i].vlen + 2);
+    }
+
+    int ret;
+    if (flags & DD_IMAGE_MPH)
+        ret = build_mph(buf, kvs, offs);
+    else
+        ret = build_buckets(buf, kvs, offs);
+
+    if (ret == DDM_OK)
+    {
+        // 换了seed之后entry中的hash也要换
+        for (i = 0; header->seed != 0 && i < num; i++)
+        {
+            struct dd_image_entry_t *entry = (struct dd_image_entry_t *)(buf + offs[i]);
+            entry->hash = (uint32_t)(image_hash(kvs[i].key, kvs[i].klen, header->seed) >> 32);
+        }
+        header->checksum = image_checksum(buf, size);
+        ret = write_file(path, buf, size);
+    }
+    free(offs);
+    free(buf);
+
+    return ret;
+}
@@ -0,0 +1,85 @@
+#ifndef _DD_IMAGE_H
+#define _DD_IMAGE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 预先生成的二进制词典文件,加载时直接mmap,不需要解析
+// 文件中只保存偏移,不保存指针,所以可以映射到任意地址
+// key和value都是映射中的指针,以'\0'结尾,只在对应版本unref之前有效
+//
+// 文件格式(本机字节序):
+//   header | disp[disp_num] | bucket[bucket_num] | entry...
+//   bucket为entry的偏移,0表示空,线性探测
+//   entry为{hash, klen, vlen, 0} key '\0' value '\0',按8字节对齐
+// DD_IMAGE_MPH时没有空的bucket(bucket_num == num),key的hash先选disp,
+// 再由disp决定唯一的bucket,查找只需要一次hash和一次探测
+// checksum覆盖整个文件(计算时checksum字段为0),加载时不检查,部署前用dd_image_verify
+
+#define DD_IMAGE_MAGIC 0x494D4444
+#define DD_IMAGE_VERSION 1
+
+// dd_image_write/header的flags
+#define DD_IMAGE_MPH 0x1
+
+struct dd_image_header_t
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t num;
+    uint32_t bucket_num;
+    uint32_t disp_num;
+    uint64_t seed;
+    uint64_t disp_off;
+    uint64_t bucket_off;
+    uint64_t data_off;
+    uint64_t size;
+    uint64_t checksum;
+};
+
+struct dd_image_entry_t
+{
+    uint32_t hash;
+    uint32_t klen;
+    uint32_t vlen;
+    uint32_t reserved;
+};
+
+struct dd_image_t;
+
+// ddm_add的ini_fun/fini_fun,ini_args为文件路径
+// 文件不完整或格式不对时返回NULL
+// 生成文件时先写临时文件再rename,正在映射的旧文件不受影响
+void *dd_image_ini(void *path);
+void dd_image_fini(void *image);
+// dd_option_t的size_fun,映射的大小,其中没有访问过的页不占内存
+size_t dd_image_size(void *image);
+
+uint32_t dd_image_num(const struct dd_image_t *image);
+// 找到返回DDM_OK,否则返回DDM_NODICT
+int dd_image_get(const struct dd_image_t *image, const char *key, size_t klen, const char **val, size_t *vlen);
+
+struct dd_image_kv_t
+{
+    const char *key;
+    size_t klen;
+    const char *val;
+    size_t vlen;
+};
+
+// 写入path(先写path.tmp再rename),重复的key返回DDM_DUP
+// 相同的输入(包括顺序)和flags总是生成相同的文件
+int dd_image_write(const char *path, const struct dd_image_kv_t *kvs, uint32_t num, int flags);
+// 读取整个文件检查格式和checksum,返回DDM_OK,num不为NULL时返回key的个数
+int dd_image_verify(const char *path, uint32_t *num);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,290 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "dyndict_manager.h"
+#include "dd_kv.h"
+#include "dd_kv_private.h"
+
+#define CACHE_LINE 64
+#define ALIGN_LINE(n) (((n) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))
+
+// hash为0表示空
+// off为blob中的偏移,长key时指向key,value紧跟在key的'\0'之后,否则指向value
+struct dd_kv_slot_t
+{
+    uint32_t hash;
+    uint32_t vlen;
+    uint64_t off;
+    uint16_t klen;
+    char key[DD_KV_INLINE_KEY];
+};
+
+struct dd_kv_t
+{
+    uint32_t num;
+    uint32_t mask;
+    size_t size;
+    struct dd_kv_slot_t *slots;
+    const char *blob;
+};
+
+// 每次8字节
+static uint64_t kv_hash(const char *key, size_t len)
+{
+    uint64_t h = len * 0x9E3779B97F4A7C15ull;
+    while (len >= sizeof (uint64_t))
+    {
+        uint64_t v;
+        memcpy(&v, key, sizeof (v));
+        h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+        key += sizeof (v);
+        len -= sizeof (v);
+    }
+    if (len > 0)
+    {
+        uint64_t v = 0;
+        memcpy(&v, key, len);
+        h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+        h ^= h >> 29;
+    }
+    h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ull;
+
+    return h ^ (h >> 32);
+}
+
+// 下标用低位,slot中保存高位
+static uint32_t slot_hash(uint64_t h)
+{
+    return (uint32_t)(h >> 32) | 1;
+}
+
+char *dd_kv_read_file(const char *path, size_t *size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    char *buf = (char *)malloc(st.st_size + 1);
+    size_t n = 0;
+    while (buf != NULL && n < (size_t)st.st_size)
+    {
+        ssize_t r = read(fd, buf + n, st.st_size - n);
+        if (r <= 0)
+        {
+            free(buf);
+            buf = NULL;
+            break;
+        }
+        n += r;
+    }
+    close(fd);
+    if (buf == NULL)
+        return NULL;
+
+    buf[n] = '\0';
+    *size = n;
+
+    return buf;
+}
+
+// 第一遍在文件内容上建表,off为key在buf中的偏移,重复的key直接替换
+// 第二遍按slot的顺序把key和value复制到blob,相邻的slot的数据也相邻
+struct dd_kv_t *dd_kv_load(const char *path, char delim)
+{
+    size_t size;
+    char *buf = dd_kv_read_file(path, &size);
+    if (buf == NULL)
+        return NULL;
+
+    size_t lines = 1;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        if (buf[i] == '\n')
+            lines++;
+    }
+
+    // 装载率不超过1/2
+    uint64_t cap = 2;
+    while (cap < 2 * (uint64_t)lines)
+        cap <<= 1;
+    if (cap > (1ull << 32))
+    {
+        free(buf);
+        return NULL;
+    }
+
+    struct dd_kv_slot_t *tmp = (struct dd_kv_slot_t *)calloc(cap, sizeof (struct dd_kv_slot_t));
+    if (tmp == NULL)
+    {
+        free(buf);
+        return NULL;
+    }
+
+    uint32_t mask = cap - 1;
+    uint32_t num = 0;
+    char *p = buf;
+    char *end = buf + size;
+    while (p < end)
+    {
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        char *next = eol + 1;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+        if (eol == p)
+        {
+            p = next;
+            continue;
+        }
+
+        char *sep = memchr(p, delim, eol - p);
+        if (sep == NULL || sep - p > DD_KV_MAX_KEY || eol - sep - 1 > UINT32_MAX)
+        {
+            free(tmp);
+            free(buf);
+            return NULL;
+        }
+
+        size_t klen = sep - p;
+        uint64_t h = kv_hash(p, klen);
+        uint32_t j;
+        for (j = h & mask; tmp[j].hash != 0; j = (j + 1) & mask)
+        {
+            if (tmp[j].hash == slot_hash(h) && tmp[j].klen == klen
+                    && memcmp(buf + tmp[j].off, p, klen) == 0)
+                break;
+        }
+        if (tmp[j].hash == 0)
+            num++;
+        tmp[j].hash = slot_hash(h);
+        tmp[j].klen = klen;
+        tmp[j].vlen = eol - sep - 1;
+        tmp[j].off = p - buf;
+        p = next;
+    }
+
+    size_t blob_size = 0;
+    for (i = 0; i < cap; i++)
+    {
+        if (tmp[i].hash == 0)
+            continue;
+        if (tmp[i].klen > DD_KV_INLINE_KEY)
+            blob_size += tmp[i].klen + 1;
+        blob_size += tmp[i].vlen + 1;
+    }
+
+    size_t head = ALIGN_LINE(sizeof (struct dd_kv_t));
+    size_t total = head + cap * sizeof (struct dd_kv_slot_t) + blob_size;
+    struct dd_kv_t *kv = NULL;
+    if (posix_memalign((void **)&kv, CACHE_LINE, total) != 0)
+    {
+        free(tmp);
+        free(buf);
+        return NULL;
+    }
+
+    kv->num = num;
+    kv->mask = mask;
+    kv->size = total;
+    kv->slots = (struct dd_kv_slot_t *)((char *)kv + head);
+    kv->blob = (char *)kv->slots + cap * sizeof (struct dd_kv_slot_t);
+
+    char *blob = (char *)kv->blob;
+    uint64_t off = 0;
+    for (i = 0; i < cap; i++)
+    {
+        struct dd_kv_slot_t *slot = &kv->slots[i];
+        *slot = tmp[i];
+        if (slot->hash == 0)
+            continue;
+
+        const char *key = buf + tmp[i].off;
+        slot->off = off;
+        if (slot->klen > DD_KV_INLINE_KEY)
+        {
+            memcpy(blob + off, key, slot->klen);
+            blob[off + slot->klen] = '\0';
+            off += slot->klen + 1;
+        }
+        else
+        {
+            memset(slot->key, 0, sizeof (slot->key));
+            memcpy(slot->key, key, slot->klen);
+        }
+        memcpy(blob + off, key + slot->klen + 1, slot->vlen);
+        blob[off + slot->vlen] = '\0';
+        off += slot->vlen + 1;
+    }
+
+    free(tmp);
+    free(buf);
+
+    return kv;
+}
+
+void *dd_kv_ini(void *path)
+{
+    return dd_kv_load((const char *)path, '\t');
+}
+
+void dd_kv_fini(void *kv)
+{
+    free(kv);
+}
+
+size_t dd_kv_size(void *kv)
+{
+    return ((struct dd_kv_t *)kv)->size;
+}
+
+uint32_t dd_kv_num(const struct dd_kv_t *kv)
+{
+    return kv->num;
+}
+
+int dd_kv_get(const struct dd_kv_t *kv, const char *key, size_t klen, const char **val, size_t *vlen)
+{
+    uint64_t h = kv_hash(key, klen);
+    uint32_t hash = slot_hash(h);
+    uint32_t i;
+    for (i = h & kv->mask; kv->slots[i].hash != 0; i = (i + 1) & kv->mask)
+    {
+        const struct dd_kv_slot_t *slot = &kv->slots[i];
+        if (slot->hash != hash || slot->klen != klen)
+            continue;
+
+        const char *data = kv->blob + slot->off;
+        if (klen <= DD_KV_INLINE_KEY)
+        {
+            if (memcmp(slot->key, key, klen) != 0)
+                continue;
+        }
+        else
+        {
+            if (memcmp(data, key, klen) != 0)
+                continue;
+            data += klen + 1;
+        }
+
+        *val = data;
+        if (vlen != NULL)
+            *vlen = slot->vlen;
+        return DDM_OK;
+    }
+
+    return DDM_NODICT;
+}
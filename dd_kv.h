@@ -0,0 +1,40 @@
+#ifndef _DD_KV_H
+#define _DD_KV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 内置的字符串词典,从分隔符分隔的文本文件加载,加载后只读
+// 开放寻址(线性探测),装载率不超过1/2,slot为32字节,一个cache line两个
+// slot中保存hash,短key直接保存在slot中,长key和value保存在slot之后连续的blob中
+// 整个词典是一次分配的连续内存
+
+// 不超过这个长度的key保存在slot中,查找时只访问slot
+#define DD_KV_INLINE_KEY 14
+#define DD_KV_MAX_KEY 65535
+
+struct dd_kv_t;
+
+// ddm_add的ini_fun/fini_fun,ini_args为文件路径,每行key\tvalue
+// 空行跳过,没有分隔符的行是错误,返回NULL;重复的key以最后一次为准
+void *dd_kv_ini(void *path);
+void dd_kv_fini(void *kv);
+// dd_option_t的size_fun
+size_t dd_kv_size(void *kv);
+
+// 使用其他分隔符
+struct dd_kv_t *dd_kv_load(const char *path, char delim);
+
+uint32_t dd_kv_num(const struct dd_kv_t *kv);
+// 找到返回DDM_OK,val以'\0'结尾,和kv的生命周期相同
+int dd_kv_get(const struct dd_kv_t *kv, const char *key, size_t klen, const char **val, size_t *vlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
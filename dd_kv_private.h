@@ -0,0 +1,13 @@
+#ifndef _DD_KV_PRIVATE_H
+#define _DD_KV_PRIVATE_H
+
+#include <stddef.h>
+
+// 只在库内部和ddm_compile之间共用,不属于dd_kv.h的接口
+
+// 读取整个文件,结尾补'\0',*size不包括'\0',失败返回NULL,由调用者free
+// 链接成共享库时不导出
+__attribute__ ((visibility ("hidden")))
+char *dd_kv_read_file(const char *path, size_t *size);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dyndict_manager.h"
+#include "dd_image.h"
+#include "dd_kv_private.h"
+
+// 把key\tvalue格式的文本词典编译成dd_image,供dd_image_ini直接mmap
+// 相同的输入总是得到相同的文件,可以用checksum比较
+//
+// ddm_compile [-l] input output   -l使用线性探测而不是最小完美hash
+// ddm_compile -c image            检查文件格式和checksum
+
+static void usage()
+{
+    fprintf(stderr, "usage: ddm_compile [-l] input output\n");
+    fprintf(stderr, "       ddm_compile -c image\n");
+}
+
+// key和value指向buf,空行跳过,没有\t的行是错误
+static struct dd_image_kv_t *parse(const char *path, char *buf, size_t size, uint32_t *num)
+{
+    uint32_t max = 0;
+    size_t i;
+    for (i = 0; i < size; i++)
+    {
+        if (buf[i] == '\n')
+            max++;
+    }
+    max++;
+
+    struct dd_image_kv_t *kvs = (struct dd_image_kv_t *)malloc(max * sizeof (struct dd_image_kv_t));
+    if (kvs == NULL)
+        return NULL;
+
+    uint32_t n = 0;
+    uint32_t line = 0;
+    char *p = buf;
+    char *end = buf + size;
+    while (p < end)
+    {
+        line++;
+        char *eol = memchr(p, '\n', end - p);
+        if (eol == NULL)
+            eol = end;
+        char *next = eol + 1;
+        if (eol > p && eol[-1] == '\r')
+            eol--;
+
+        if (eol > p)
+        {
+            char *tab = memchr(p, '\t', eol - p);
+            if (tab == NULL)
+            {
+                fprintf(stderr, "%s:%u: missing tab\n", path, line);
+                free(kvs);
+                return NULL;
+            }
+            kvs[n].key = p;
+            kvs[n].klen = tab - p;
+            kvs[n].val = tab + 1;
+            kvs[n].vlen = eol - tab - 1;
+            n++;
+        }
+        p = next;
+    }
+
+    *num = n;
+
+    return kvs;
+}
+
+static int verify(const char *path)
+{
+    uint32_t num;
+    int ret = dd_image_verify(path, &num);
+    if (ret != DDM_OK)
+    {
+        fprintf(stderr, "%s: bad image (%d)\n", path, ret);
+        return 1;
+    }
+
+    struct dd_image_header_t header;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || read(fd, &header, sizeof (header)) != sizeof (header))
+    {
+        if (fd != -1)
+            close(fd);
+        fprintf(stderr, "%s: read failed\n", path);
+        return 1;
+    }
+    close(fd);
+
+    printf("%s: %u keys, %llu bytes, %s, checksum %016llx\n", path, num,
+            (unsigned long long)header.size, (header.flags & DD_IMAGE_MPH) ? "mph" : "linear",
+            (unsigned long long)header.checksum);
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int flags = DD_IMAGE_MPH;
+    int check = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "lc")) != -1)
+    {
+        if (opt == 'l')
+            flags &= ~DD_IMAGE_MPH;
+        else if (opt == 'c')
+            check = 1;
+        else
+        {
+            usage();
+            return 2;
+        }
+    }
+
+    if (check)
+    {
+        if (optind + 1 != argc)
+        {
+            usage();
+            return 2;
+        }
+        return verify(argv[optind]);
+    }
+
+    if (optind + 2 != argc)
+    {
+        usage();
+        return 2;
+    }
+    const char *input = argv[optind];
+    const char *output = argv[optind + 1];
+
+    size_t size;
+    char *buf = dd_kv_read_file(input, &size);
+    if (buf == NULL)
+    {
+        fprintf(stderr, "%s: read failed\n", input);
+        return 1;
+    }
+
+    uint32_t num;
+    struct dd_image_kv_t *kvs = parse(input, buf, size, &num);
+    if (kvs == NULL)
+    {
+        free(buf);
+        return 1;
+    }
+
+    int ret = dd_image_write(output, kvs, num, flags);
+    free(kvs);
+    free(buf);
+    if (ret != DDM_OK)
+    {
+        fprintf(stderr, "%s: %s\n", output, ret == DDM_DUP ? "duplicate key" : "write failed");
+        return 1;
+    }
+
+    // 写完再完整检查一遍,和部署前的检查相同
+    return verify(output);
+}
@@ -1,13 +1,25 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <limits.h>
+#include <malloc.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <oop.h>
 
 #include "dyndict_manager.h"
+#include "dd_kv.h"
+#include "dd_arena.h"
 
 #define DD_STAT 0xF
 #define DD_EMPTY 0x0
@@ -16,8 +28,23 @@
 #define DD_DONE 0x4
 #define DD_FAIL 0x8
 
+// dd->flag,只由oop修改,避免和ddm修改stat相互覆盖
 #define DD_LOAD_FAIL 0x10
 #define DD_NEED_RELOAD 0x20
+// oop已经收到del命令,此后计数降为0才能真正删除
+#define DD_DELETING 0x40
+// 首次加载成功,ddm_add只会被通知一次
+#define DD_LOADED 0x80
+// loader线程正在处理这个dd的job
+#define DD_LOADING 0x100
+// 同时加载的dd达到max_loading,在等待队列中
+#define DD_LOAD_WAIT 0x200
+// 在等待reload_burst的名额
+#define DD_RATE_WAIT 0x400
+// oop处理这个dd的ref/unref消息,删除完成(或首次加载失败)时清除
+#define DD_LISTEN 0x800
+// watch的文件在上次开始加载之后有变化
+#define DD_WATCH_DIRTY 0x1000
 
 #define DD_REF 'R'
 #define DD_UNREF 'U'
@@ -27,13 +54,26 @@
 #define DDM_DEAD 0x44454144 /* "DEAD" */
 
 #define MAX_QUEUE_SIZE 1024
-#define MAX_DICT_NUM 2
-
-#define PIPE_NUM 2
-#define PIPE_READ 0
-#define PIPE_WRITE 1
+// watch模式下文件最后一次变化之后等待的时间
+#define DEF_DEBOUNCE_MS 200
+#define WATCH_MASK (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)
+
+// 控制队列大小,必须是2的幂
+#define CMD_QUEUE_SIZE 1024
+#define MAX_DICT_NUM DDM_MAX_VERSION_NUM
+#define DEF_DICT_NUM 2
+// 连续增量加载的次数
+#define DEF_FULL_EVERY 16
+// reclaimer最多积压的版本数
+#define DEF_RECLAIM_MAX 64
+// reload_burst的窗口
+#define DEF_RELOAD_WINDOW_MS 1000
+#define DEF_PHASE_PERIOD_MS 60000
 
 #define DEF_DD_NUM 100
+#define DEF_READER_NUM 256
+// DDM_REF_EPOCH下等待读区间退出时的检查间隔
+#define EPOCH_POLL_MS 10
 
 #define CMD_DD 'D'
 #define CMD_EXIT 'E'
@@ -41,35 +81,44 @@
 typedef void *(*ini_fun_t)(void *);
 typedef void (*fini_fun_t)(void *);
 
+// 一次ref/unref,type为DD_REF/DD_UNREF
+struct info_msg_t
+{
+    void *dict;
+    char type;
+};
+
+// data只在非DDM_REF_ATOMIC下分配,其他模式不使用队列
 struct trival_queue_t
 {
-    void *data[MAX_QUEUE_SIZE];
+    struct info_msg_t *data;
     int head;
     int tail;
     int num;
 };
 
-void *tq_get(struct trival_queue_t *tq)
+int tq_get(struct trival_queue_t *tq, struct info_msg_t *msg)
 {
     if (tq->num <= 0)
-        return NULL;
+        return -1;
 
     tq->num--;
-    void *ret = tq->data[tq->head];
+    *msg = tq->data[tq->head];
     tq->head++;
     if (tq->head >= MAX_QUEUE_SIZE)
         tq->head = 0;
 
-    return ret;
+    return 0;
 }
 
-int tq_put(struct trival_queue_t *tq, void *d)
+int tq_put(struct trival_queue_t *tq, void *d, char type)
 {
-    if (tq->num > MAX_QUEUE_SIZE)
+    if (tq->num >= MAX_QUEUE_SIZE)
         return -1;
 
     tq->num++; 
-    tq->data[tq->tail] = d;
+    tq->data[tq->tail].dict = d;
+    tq->data[tq->tail].type = type;
     tq->tail++;
     if (tq->tail >= MAX_QUEUE_SIZE)
         tq->tail = 0;
@@ -78,38 +127,372 @@ int tq_put(struct trival_queue_t *tq, void *d)
 }
 
 // 单向传递,dd/ddm -> oop
+// 入队后把dd放入所在shard的就绪队列,由oop一起处理
 struct info_queue_t
 {
     struct trival_queue_t tq;
     pthread_mutex_t mutex;
-    int pipefd[PIPE_NUM];
+};
+
+// 控制队列的槽位,seq等于入队位置时可写,等于位置+1时可读
+struct cmd_cell_t
+{
+    uint64_t seq;
+    int cmd;
+    void *data;
+};
+
+// ddm -> oop的控制队列,多生产者单消费者,有界无锁
+// 队列满时cq_put失败,由调用者决定返回DDM_OVERFLOW还是重试
+struct cmd_queue_t
+{
+    struct cmd_cell_t cells[CMD_QUEUE_SIZE];
+    // 生产者竞争tail,和消费者的head分开cache line
+    uint64_t tail __attribute__ ((aligned (64)));
+    uint64_t head __attribute__ ((aligned (64)));
+    // 已经写过eventfd且oop尚未取走,此后入队不再重复唤醒
+    int notified;
+    int efd;
+};
+
+static void cq_ini(struct cmd_queue_t *cq)
+{
+    uint64_t i;
+    for (i = 0; i < CMD_QUEUE_SIZE; i++)
+        cq->cells[i].seq = i;
+    cq->tail = cq->head = 0;
+    cq->notified = 0;
+    cq->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+}
+
+static int cq_put(struct cmd_queue_t *cq, int cmd, void *data)
+{
+    uint64_t pos = __atomic_load_n(&cq->tail, __ATOMIC_RELAXED);
+    struct cmd_cell_t *cell;
+    while (1)
+    {
+        cell = &cq->cells[pos & (CMD_QUEUE_SIZE - 1)];
+        uint64_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&cq->tail, &pos, pos + 1, 1,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+            return -1;
+        else
+            pos = __atomic_load_n(&cq->tail, __ATOMIC_RELAXED);
+    }
+
+    cell->cmd = cmd;
+    cell->data = data;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    // 先入队再检查notified,和in_notify先清notified再取的顺序相反
+    if (__atomic_exchange_n(&cq->notified, 1, __ATOMIC_SEQ_CST) == 0)
+    {
+        uint64_t one = 1;
+        write(cq->efd, &one, sizeof (one));
+    }
+
+    return 0;
+}
+
+// 只由oop调用
+static int cq_get(struct cmd_queue_t *cq, int *cmd, void **data)
+{
+    struct cmd_cell_t *cell = &cq->cells[cq->head & (CMD_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != cq->head + 1)
+        return -1;
+
+    *cmd = cell->cmd;
+    *data = cell->data;
+    __atomic_store_n(&cell->seq, cq->head + CMD_QUEUE_SIZE, __ATOMIC_RELEASE);
+    cq->head++;
+
+    return 0;
+}
+
+// DDM_REF_EPOCH下一个线程的读区间,独占cache line
+// epoch为进入时的ddm->epoch,0表示不在读区间
+struct dd_reader_t
+{
+    uint64_t epoch;
+    int used;
+    int depth;
+} __attribute__ ((aligned (64)));
+
+// DDM_REF_CACHE下一个线程对一个dd缓存的版本
+// 线程持有该版本的一个计数(pin),直到dd->version改变后再次ref(或unref)时才释放
+struct dd_cache_entry_t
+{
+    void *dict;
+    int index;
+    uint32_t gen;
+    uint32_t version;
+    // 本线程尚未unref的次数,-1表示没有pin
+    // 为0时ddm_del/ddm_fini和推迟的reload可以取走这个pin(revoke_pins),读取字段期间为-2
+    int local;
+};
+
+// 按dds下标索引
+struct dd_cache_t
+{
+    struct dd_manager_t *ddm;
+    struct dd_cache_t *next;
+    struct dd_cache_entry_t entries[];
+};
+
+struct dd_manager_t;
+struct dd_shard_t;
+struct dyndict_t;
+
+#define JOB_LOAD 1
+#define JOB_FINI 2
+
+// 交给loader线程的ini_fun/fini_fun,每个dd同时最多一个
+struct dd_job_t
+{
+    struct dd_job_t *next;
+    struct dyndict_t *dd;
+    int type;
+    // JOB_LOAD:先fini被替换的old,再加载到slot
+    // base不为NULL时在base上增量加载
+    int slot;
+    void *old;
+    struct dd_arena_t *old_arena;
+    void *base;
+    void *dict;
+    struct dd_arena_t *arena;
+    size_t size;
+    int delta;
+};
+
+// ini_fun/fini_fun不在oop线程中执行,完成后通过efd通知oop切换
+struct dd_loader_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct dd_job_t *head;
+    struct dd_job_t *tail;
+    // 已完成,等待oop取走
+    struct dd_job_t *done;
+    int efd;
+    int stop;
+
+    pthread_t *pids;
+    int num;
+
+    // 下面只由oop修改
+    int max_loading;
+    int loading;
+    int jobs;
+    // 已经add_dd但还没有删除完成的dd数,退出时要等它们的job
+    int active;
+    int exiting;
+    // 等待加载的dd,按先后顺序
+    struct dyndict_t *wait_head;
+    struct dyndict_t *wait_tail;
+};
+
+// 不再使用的版本,等待reclaimer线程fini
+struct dd_reclaim_node_t
+{
+    struct dd_reclaim_node_t *next;
+    void *dict;
+    fini_fun_t fini_fun;
+    struct dd_arena_t *arena;
+    size_t size;
+    uint64_t since;
+};
+
+// fini_fun不在oop/loader线程中执行,释放很大的词典不会推迟加载和消息处理
+struct dd_reclaimer_t
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    struct dd_reclaim_node_t *head;
+    struct dd_reclaim_node_t *tail;
+    int stop;
+    int trim;
+    // 积压超过max时在当前线程fini,限制积压的内存
+    uint64_t max;
+    pthread_t pid;
+
+    // ddm_reclaim_stat,正在fini的版本也算在pending中
+    uint64_t pending;
+    size_t pending_mem;
+    uint64_t reclaimed;
+    uint64_t reclaim_ms;
+    uint64_t busy_since;
+};
+
+// 一组需要一致使用的dd,各自加载,全部加载完毕后一起切换
+struct dd_group_t
+{
+    const char *name;
+    struct dd_group_t *next;
+
+    // 切换(写锁)和ddm_ref_group(读锁)互斥
+    pthread_rwlock_t rwlock;
+    // 位置固定,已删除的成员dd->group不再指向本group
+    struct dyndict_t **members;
+    int num;
+    int live;
+    // ddm_del还没有完成的成员数,由ddm写锁保护,为0时释放group
+    int remain;
+    // 已经加载好新版本等待切换的成员数,只由oop修改
+    int staged;
 };
 
 struct dyndict_t
 {
+    struct dd_manager_t *ddm;
+    // 由ddm_add分配,之后只由这个shard的oop处理
+    struct dd_shard_t *shard;
     int stat;
+    int flag;
     const char *name;
+    uint32_t hash;
+    // 槽位变为DD_EMPTY时加1,使旧的dd_handle_t失效
+    uint32_t gen;
 
     ini_fun_t ini_fun;
     void *ini_args;
     fini_fun_t fini_fun;
+    // 设置时代替ini_fun,每个版本一个arena
+    void *(*arena_fun)(void *, struct dd_arena_t *);
+    size_t arena_chunk;
     // fini_args is dict itself
     // 上面的数据主要由ddm操作
 
     // 初始化由ddm,操作改变由oop
     int intval_s;
+    // 使用的版本数,不超过MAX_DICT_NUM
+    int dict_num;
+    size_t mem_cap;
+    size_t (*size_fun)(void *);
+    // watch模式,监听watch_path所在目录,-1表示不监听
+    const char *watch_path;
+    const char *watch_name;
+    int watch_wd;
+    // 同一shard中watch模式的dd,只由oop修改
+    struct dyndict_t *watch_next;
+    int debounce_ms;
+    // 数据源的指纹和上次加载时相同就跳过reload
+    int (*finger_fun)(void *, uint64_t *);
+    // 当前版本对应的指纹,finger_ok为0表示没有
+    uint64_t finger;
+    int finger_ok;
+    // 将要加载的版本的指纹
+    uint64_t next_finger;
+    int next_finger_ok;
+    // 增量加载,连续full_every次之后全量加载一次
+    void *(*delta_fun)(void *, void *);
+    int full_every;
+    int delta_num;
+    // 第一次定时reload额外推迟phase_ms,phase_pending表示还没有使用
+    int phase_ms;
+    int phase_pending;
+    int jitter_ms;
+    // 分步加载,stream为begin_fun返回的状态
+    void *(*begin_fun)(void *);
+    int (*step_fun)(void *);
+    void *(*finish_fun)(void *, int);
+    void *stream;
+    struct timeval step_tv;
     pthread_rwlock_t rwlock;
-    // 通知ddm的dd首次加载完毕或卸载完毕
-    int oop2dd[PIPE_NUM];
+    // 通知ddm的dd首次加载完毕或卸载完毕,由iq.mutex保护
+    int done;
+    pthread_cond_t done_cond;
     // 通知oop的dd的ref/unref操作
-    // 队列为dict
     struct info_queue_t iq;
+    // 已经在shard的就绪队列中,这时不再重复放入
+    // 为1时槽位不能被ddm_add重用,oop取出时清除
+    int ready;
+    struct dyndict_t *ready_next;
 
     // 下面的数据主要由oop操作
     struct timeval reload_tv;
+    // dicts/sizes/count会被其他线程读取,都用原子操作访问
     void *dicts[MAX_DICT_NUM];
+    // DDM_REF_ATOMIC下由ref/unref原子修改
     int count[MAX_DICT_NUM];
     int index;
+    // 有等待中的reload/del,unref降为0时需要唤醒oop
+    int wait;
+    // 版本不再是index时的ddm->epoch,早于它进入的读区间可能还在使用
+    uint64_t retire[MAX_DICT_NUM];
+    // index切换或开始删除时加1,DDM_REF_CACHE据此判断缓存是否过期
+    uint32_t version;
+    // 加载时由size_fun得到
+    size_t sizes[MAX_DICT_NUM];
+    // arena_fun时版本对应的arena,fini之后释放
+    struct dd_arena_t *arenas[MAX_DICT_NUM];
+
+    // ddm_stat,只由oop修改
+    uint64_t loads;
+    uint64_t defer_busy;
+    uint64_t defer_mem;
+    uint64_t skips;
+    uint64_t deltas;
+    uint64_t defer_rate;
+    // 计数从0变为1的时间(毫秒),由增加计数的一方写入
+    uint64_t hold_since[MAX_DICT_NUM];
+    // DD_NEED_RELOAD开始的时间,0表示没有等待中的reload
+    uint64_t need_since;
+
+    struct dd_job_t job;
+    struct dyndict_t *wait_next;
+    struct dyndict_t *rate_next;
+
+    // 所属的group,由ddm_group_add设置
+    struct dd_group_t *group;
+    // 已经加载等待group一起切换的版本,-1表示没有
+    int staged;
+};
+
+// 一个oop线程和它管理的dd
+// dd按名字的hash(或dd_option_t的shard)分配到shard,之后的ref/unref消息,加载和控制命令都只由这个shard处理
+// 不同shard之间不共享队列,定时器和loader
+struct dd_shard_t
+{
+    struct dd_manager_t *ddm;
+    int id;
+
+    struct cmd_queue_t cq;
+    // 这个shard中所有watch模式的dd共用
+    int inotify_fd;
+    struct dyndict_t *watch_head;
+    // loader_num为0时为NULL,在oop线程中加载
+    struct dd_loader_t *loader;
+    pthread_t oop_pid;
+    // 设置了DD_LISTEN的dd数,退出时等待它们全部删除
+    int listen_num;
+    int exiting;
+
+    // 下面只由oop修改
+    // 等待名额的dd,按先后顺序,有名额时由rate_tv定时器执行
+    struct dyndict_t *rate_wait_head;
+    struct dyndict_t *rate_wait_tail;
+    struct dyndict_t *rate_running;
+    struct timeval rate_tv;
+    int rate_armed;
+    // 正在执行的reload占用的名额,没有开始加载时由rate_cancel归还,-1表示没有
+    int rate_slot;
+    uint64_t rate_prev;
+    unsigned int rand_seed;
+    // ddm_reload_stat
+    uint64_t reload_starts;
+    uint64_t reload_deferred;
+    uint64_t phases[DDM_PHASE_BUCKETS];
+
+    // 有ref/unref消息(或DDM_REF_ATOMIC下需要唤醒)的dd,多生产者入栈,oop一次取走全部
+    // 由空变为非空时写ready_efd;和上面oop修改的字段分开cache line
+    struct dyndict_t *ready_head __attribute__ ((aligned (64)));
+    int ready_efd;
 };
 
 struct dd_manager_t
@@ -117,619 +500,3023 @@ struct dd_manager_t
     struct dyndict_t *dds;
     int num;
     int max;
+    int flags;
+
+    // name -> dds下标,开放寻址(线性探测),-1为空
+    // 由add/del在写锁下维护
+    int *index;
+    uint32_t index_mask;
+
+    // DDM_REF_EPOCH
+    uint64_t epoch;
+    struct dd_reader_t *readers;
+    int reader_num;
+    pthread_key_t reader_key;
+
+    // DDM_REF_CACHE
+    pthread_key_t cache_key;
+    // 所有线程的dd_cache_t,线程退出时移除,ddm_fini释放剩下的
+    pthread_mutex_t cache_mutex;
+    struct dd_cache_t *caches;
+
+    // 由ddm->rwlock保护
+    struct dd_group_t *groups;
 
     pthread_rwlock_t rwlock;
 
-    // need to be nonblock 
-    struct info_queue_t iq;
-    pthread_t oop_pid;
+    struct dd_reclaimer_t *reclaimer;
+    struct dd_shard_t *shards;
+    int shard_num;
+
+    // reload_burst,所有shard共用一个窗口,由rate_mutex保护
+    // 最近reload_burst次reload开始的时间(毫秒),rate_head为最早的一次
+    pthread_mutex_t rate_mutex;
+    uint64_t *rate_ring;
+    int rate_head;
+    int rate_num;
+    int rate_window_ms;
+    // ddm_reload_stat,burst为从burst_since开始的窗口中开始的reload数
+    uint64_t burst_since;
+    int burst;
+    int max_burst;
+    int phase_period_ms;
 
     uint32_t magic;
 };
 
-static void *reload(oop_source_t *oop, struct timeval tv, void *args);
-
-static int load_dd(oop_source_t *oop, struct dyndict_t *dd, int next)
+// 只用于统计持续时间,不受系统时间调整影响
+static uint64_t now_ms()
 {
-    int ret = 0;
-    if (dd->dicts[next] != NULL && dd->fini_fun != NULL)
-        dd->fini_fun(dd->dicts[next]);
-    dd->dicts[next] = dd->ini_fun(dd->ini_args);
-    if (dd->dicts[next] == NULL)
-    {
-        dd->stat |= DD_LOAD_FAIL;
-        ret = -1;
-        goto LB_DONE;
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-    pthread_rwlock_wrlock(&dd->rwlock);
-    dd->index = next;
-    pthread_rwlock_unlock(&dd->rwlock);
+static uint64_t finger_mix(uint64_t h, uint64_t v)
+{
+    h = (h ^ v) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
 
-LB_DONE:
-    if (dd->stat & DD_ADD)
-    {
-        char msg = CMD_DD;
-        write(dd->oop2dd[PIPE_WRITE], &msg, sizeof (char));
-    }
+int ddm_finger_file(void *path, uint64_t *finger)
+{
+    struct stat st;
+    if (stat((const char *)path, &st) != 0)
+        return -1;
 
-    gettimeofday(&dd->reload_tv, NULL);
-    dd->reload_tv.tv_sec += dd->intval_s;
-    oop_add_time(oop, dd->reload_tv, reload, dd);
+    uint64_t h = 0;
+    h = finger_mix(h, st.st_dev);
+    h = finger_mix(h, st.st_ino);
+    h = finger_mix(h, st.st_size);
+    h = finger_mix(h, st.st_mtim.tv_sec);
+    h = finger_mix(h, st.st_mtim.tv_nsec);
+    h = finger_mix(h, st.st_ctim.tv_sec);
+    h = finger_mix(h, st.st_ctim.tv_nsec);
+    *finger = h;
 
-    return ret;
+    return 0;
 }
 
-static int del_dd(oop_source_t *oop, struct dyndict_t *dd)
+// 每次8字节,比逐字节的FNV快很多,只用于判断内容是否变化
+int ddm_finger_file_hash(void *path, uint64_t *finger)
 {
-    oop_remove_time(oop, dd->reload_tv, reload, dd);
-    int i;
-    int over = 1;
-    for (i = 0; i < MAX_DICT_NUM; i++)
+    int fd = open((const char *)path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    uint64_t buf[8192];
+    uint64_t h = 0;
+    uint64_t size = 0;
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof (buf))) > 0)
     {
-        if (dd->dicts[i] != NULL)
+        size_t words = n / sizeof (uint64_t);
+        size_t i;
+        for (i = 0; i < words; i++)
+            h = finger_mix(h, buf[i]);
+        if (n % sizeof (uint64_t) != 0)
         {
-            if (dd->count[i] > 0)
-                over = 0;
-            else if (dd->fini_fun != NULL)
-            {
-                dd->fini_fun(dd->dicts[i]);
-                dd->dicts[i] = NULL;
-            }
+            uint64_t tail = 0;
+            memcpy(&tail, (char *)buf + words * sizeof (uint64_t), n % sizeof (uint64_t));
+            h = finger_mix(h, tail);
         }
+        size += n;
     }
-
-    if (over == 1)
-    {
-        oop_remove_fd(oop, dd->iq.pipefd[PIPE_READ], OOP_READ);
-        char msg = CMD_DD;
-        write(dd->oop2dd[PIPE_WRITE], &msg, sizeof (char));
+    close(fd);
+    if (n < 0)
         return -1;
-    }
+
+    *finger = finger_mix(h, size);
 
     return 0;
 }
 
-
-static int check(oop_source_t *oop, struct dyndict_t *dd, int pos)
+// FNV-1a
+static uint32_t dd_hash(const char *name)
 {
-    if (dd->stat & DD_NEED_RELOAD)
+    uint32_t h = 2166136261u;
+    while (*name != '\0')
     {
-        if (load_dd(oop, dd, pos) == 0)
-            dd->stat &= ~DD_NEED_RELOAD;
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
     }
-    else if ((dd->stat & DD_STAT) == DD_DEL)
-        del_dd(oop, dd);
 
-    return 0;
+    return h;
 }
 
-// 应该需要触发条件吧?
-// reload需要count降为0
-static void *check_dd(oop_source_t *oop, int fd, oop_event_t event, void *args)
+static struct dyndict_t *index_find(struct dd_manager_t *ddm, const char *name, uint32_t hash)
 {
-    struct dyndict_t *dd = (struct dyndict_t *)args;
-    char msg;
-    read(fd, &msg, sizeof (char));
+    uint32_t pos = hash & ddm->index_mask;
+    while (ddm->index[pos] != -1)
+    {
+        struct dyndict_t *dd = &ddm->dds[ddm->index[pos]];
+        if (dd->hash == hash && strcmp(dd->name, name) == 0)
+            return dd;
+        pos = (pos + 1) & ddm->index_mask;
+    }
 
-    void *dict;
-    pthread_mutex_lock(&dd->iq.mutex);
-    dict = tq_get(&dd->iq.tq);
-    pthread_mutex_unlock(&dd->iq.mutex);
+    return NULL;
+}
 
-    if (dict == NULL)
-        return OOP_CONTINUE;
+static void index_insert(struct dd_manager_t *ddm, struct dyndict_t *dd)
+{
+    uint32_t pos = dd->hash & ddm->index_mask;
+    while (ddm->index[pos] != -1)
+        pos = (pos + 1) & ddm->index_mask;
+    ddm->index[pos] = dd - ddm->dds;
+}
 
-    int i;
-    for (i = 0; i < MAX_DICT_NUM; i++)
+// 删除后把后续探测链上的项前移,不需要墓碑
+static void index_remove(struct dd_manager_t *ddm, struct dyndict_t *dd)
+{
+    uint32_t pos = dd->hash & ddm->index_mask;
+    while (ddm->index[pos] != dd - ddm->dds)
+        pos = (pos + 1) & ddm->index_mask;
+
+    uint32_t next = pos;
+    while (1)
     {
-        if (dict == dd->dicts[i])
+        ddm->index[pos] = -1;
+        while (1)
         {
-            if (msg == DD_REF)
-                dd->count[i]++;
-            else if (msg == DD_UNREF)
-            {
-                dd->count[i]--;
-                if (dd->count[i] == 0)
-                    check(oop, dd, i);
-            }
-            break;
+            next = (next + 1) & ddm->index_mask;
+            if (ddm->index[next] == -1)
+                return;
+            // next的理想位置不在(pos, next]之间,才能前移到pos
+            uint32_t home = ddm->dds[ddm->index[next]].hash & ddm->index_mask;
+            if (((next - home) & ddm->index_mask) >= ((next - pos) & ddm->index_mask))
+                break;
         }
+        ddm->index[pos] = ddm->index[next];
+        pos = next;
     }
-
-    return OOP_CONTINUE;
 }
 
-
-static int find_next_dict(struct dyndict_t *dd)
+// 槽位重新变为DD_EMPTY
+// 持有dd写锁,等待正在入队的ref/unref完成后才能置为DD_EMPTY
+static void release_dd(struct dd_manager_t *ddm, struct dyndict_t *dd)
 {
-    int next = (dd->index + 1) % MAX_DICT_NUM;
-    while (next != dd->index && dd->count[next] > 0)
-        next = (next + 1) % MAX_DICT_NUM;
-
-    if (next == dd->index)
-        return -1;
-    else
-        return next;
+    pthread_rwlock_wrlock(&ddm->rwlock);
+    index_remove(ddm, dd);
+    ddm->num--;
+    pthread_rwlock_wrlock(&dd->rwlock);
+    __atomic_store_n(&dd->stat, DD_EMPTY, __ATOMIC_SEQ_CST);
+    dd->group = NULL;
+    __atomic_add_fetch(&dd->gen, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&dd->rwlock);
+    pthread_rwlock_unlock(&ddm->rwlock);
 }
 
+static void *reload(oop_source_t *oop, struct timeval tv, void *args);
+static void unwatch_dd(struct dyndict_t *dd);
 
-// 资源正在使用,怎么办?
-// 不进行加载,直到发现空余词典之前,使用旧词典
-static void *reload(oop_source_t *oop, struct timeval tv, void *args)
+// 每个dd最多只有一个reload定时器
+static void arm_reload(oop_source_t *oop, struct dyndict_t *dd, int ms)
 {
-    struct dyndict_t *dd = (struct dyndict_t *)args;
-
-    if (dd->stat & DD_ADD)
+    oop_remove_time(oop, dd->reload_tv, reload, dd);
+    oop_gettime(&dd->reload_tv);
+    dd->reload_tv.tv_sec += ms / 1000;
+    dd->reload_tv.tv_usec += ms % 1000 * 1000;
+    if (dd->reload_tv.tv_usec >= 1000000)
     {
-        load_dd(oop, dd, 0);
-        return OOP_CONTINUE;
+        dd->reload_tv.tv_sec++;
+        dd->reload_tv.tv_usec -= 1000000;
     }
+    oop_add_time(oop, dd->reload_tv, reload, dd);
+}
 
-    // 当前使用index,不使用next
-    // 所以无需担心同步问题
-    int next = find_next_dict(dd);
-    if (next == -1)
+// 定时reload,watch模式下只有intval_s>0时才定时
+static void arm_interval(oop_source_t *oop, struct dyndict_t *dd)
+{
+    if (dd->watch_wd != -1 && dd->intval_s <= 0)
+        return;
+
+    int ms = dd->intval_s * 1000;
+    if (dd->phase_pending)
     {
-        dd->stat |= DD_NEED_RELOAD;
-        return OOP_CONTINUE;
+        dd->phase_pending = 0;
+        ms += dd->phase_ms;
     }
+    if (dd->jitter_ms > 0)
+        ms += rand_r(&dd->shard->rand_seed) % ((unsigned int)dd->jitter_ms + 1);
+    arm_reload(oop, dd, ms);
+}
 
-    load_dd(oop, dd, next);
+// 窗口中已经开始了reload_burst次reload时,返回还要等待的毫秒数
+// 调用者持有rate_mutex
+static int rate_left(struct dd_manager_t *ddm, uint64_t now)
+{
+    uint64_t oldest = ddm->rate_ring[ddm->rate_head];
+    if (oldest == 0 || now - oldest >= (uint64_t)ddm->rate_window_ms)
+        return 0;
 
-    return OOP_CONTINUE;
+    return oldest + ddm->rate_window_ms - now;
 }
 
-static int add_dd(oop_source_t *oop, struct dyndict_t *dd)
+// 只查看,不占用名额
+static int rate_wait(struct dd_manager_t *ddm)
 {
-    dd->index = 0;
-    memset(dd->dicts, 0, sizeof (MAX_DICT_NUM * sizeof (void *)));
-    memset(dd->count, 0, sizeof (MAX_DICT_NUM * sizeof (int)));
+    if (ddm->rate_num == 0)
+        return 0;
 
-    oop_add_fd(oop, dd->iq.pipefd[OOP_READ], OOP_READ, check_dd, dd);
-    gettimeofday(&dd->reload_tv, NULL);
-    oop_add_time(oop, dd->reload_tv, reload, dd);
+    pthread_mutex_lock(&ddm->rate_mutex);
+    int ms = rate_left(ddm, now_ms());
+    pthread_mutex_unlock(&ddm->rate_mutex);
 
-    return 0;
+    return ms;
 }
 
-static void *in_notify(oop_source_t *oop, int fd, oop_event_t event, void *args)
+// 有名额时占用一个并返回0,否则返回还要等待的毫秒数
+// 检查和占用在同一个锁中,不同shard不会同时拿到最后一个名额
+static int rate_take(struct dd_shard_t *shard)
 {
-    char msg;
-    struct info_queue_t *iq = (struct info_queue_t *)args;
-
-    pthread_mutex_lock(&iq->mutex);
-
-    while (read(fd, &msg, sizeof (char)) != -1)
+    struct dd_manager_t *ddm = shard->ddm;
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&ddm->rate_mutex);
+    int ms = rate_left(ddm, now);
+    if (ms == 0)
     {
-        if (msg == CMD_EXIT)
-        {
-            oop_remove_fd(oop, fd, OOP_READ);
-            break;
-        }
-        else if (msg == CMD_DD)
-        {
-            struct dyndict_t *dd = (struct dyndict_t *)tq_get(&iq->tq);
-            if (dd->stat == DD_ADD)
-                add_dd(oop, dd);
-            else if (dd->stat == DD_DEL)
-                del_dd(oop, dd);
-        }
+        shard->rate_slot = ddm->rate_head;
+        shard->rate_prev = ddm->rate_ring[ddm->rate_head];
+        ddm->rate_ring[ddm->rate_head] = now;
+        ddm->rate_head = (ddm->rate_head + 1) % ddm->rate_num;
     }
+    pthread_mutex_unlock(&ddm->rate_mutex);
 
-    pthread_mutex_unlock(&iq->mutex);
-
-    return OOP_CONTINUE;
+    return ms;
 }
 
-static void *oop_thread(void *args)
+// 占用了名额但没有开始加载(指纹未变,没有空闲版本等)
+// 之后没有其他reload占用时恢复原状,否则置为0,轮到这个位置时可以直接使用
+static void rate_cancel(struct dd_shard_t *shard)
 {
-    struct info_queue_t *iq = (struct info_queue_t *)args;
-    struct oop_source_t *oop = oop_sys_new();
-
-    oop_add_fd(oop, iq->pipefd[PIPE_READ], OOP_READ, in_notify, iq);
-
-    oop_run(oop, 0);
-
-    oop_del(oop);
+    if (shard->rate_slot == -1)
+        return;
 
-    return NULL;
+    struct dd_manager_t *ddm = shard->ddm;
+    pthread_mutex_lock(&ddm->rate_mutex);
+    if ((shard->rate_slot + 1) % ddm->rate_num == ddm->rate_head)
+    {
+        ddm->rate_ring[shard->rate_slot] = shard->rate_prev;
+        ddm->rate_head = shard->rate_slot;
+    }
+    else
+        ddm->rate_ring[shard->rate_slot] = 0;
+    pthread_mutex_unlock(&ddm->rate_mutex);
+    shard->rate_slot = -1;
 }
 
-struct dd_manager_t *ddm_ini(int max_num)
+// 记录一次reload开始加载,占用的名额不再归还
+// 没有占用名额时(等待空闲版本之后开始的reload)也计入窗口
+static void note_reload(struct dd_shard_t *shard)
 {
-    struct dd_manager_t *ddm = (struct dd_manager_t *)malloc(sizeof (struct dd_manager_t));
-    if (ddm == NULL)
-        return NULL;
+    struct dd_manager_t *ddm = shard->ddm;
+    uint64_t now = now_ms();
 
-    if (max_num <= 0)
-        max_num = DEF_DD_NUM;
-    ddm->dds = (struct dyndict_t *)malloc(max_num * sizeof (struct dyndict_t));
-    if (ddm->dds == NULL)
+    pthread_mutex_lock(&ddm->rate_mutex);
+    if (ddm->rate_num > 0 && shard->rate_slot == -1)
     {
-        free(ddm);
-        return NULL;
+        ddm->rate_ring[ddm->rate_head] = now;
+        ddm->rate_head = (ddm->rate_head + 1) % ddm->rate_num;
     }
+    shard->rate_slot = -1;
+    if (now - ddm->burst_since >= (uint64_t)ddm->rate_window_ms)
+    {
+        ddm->burst_since = now;
+        ddm->burst = 0;
+    }
+    ddm->burst++;
+    if (ddm->burst > ddm->max_burst)
+        __atomic_store_n(&ddm->max_burst, ddm->burst, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&ddm->rate_mutex);
+
+    int bucket = now % shard->ddm->phase_period_ms * DDM_PHASE_BUCKETS / shard->ddm->phase_period_ms;
+    __atomic_add_fetch(&shard->phases[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&shard->reload_starts, 1, __ATOMIC_RELAXED);
+}
 
-    ddm->max = max_num;
-    ddm->num = 0;
-
-    pthread_rwlock_init(&ddm->rwlock, NULL);
+static void *rate_release(oop_source_t *oop, struct timeval tv, void *args);
 
-    struct trival_queue_t *tq = &ddm->iq.tq;
-    tq->head = tq->tail = 0;
-    tq->num = 0;
-    pthread_mutex_init(&ddm->iq.mutex, NULL);
-    pipe(ddm->iq.pipefd); 
-    fcntl(ddm->iq.pipefd[PIPE_READ], F_SETFL, O_NONBLOCK);
-    fcntl(ddm->iq.pipefd[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+static void arm_rate(oop_source_t *oop, struct dd_shard_t *shard, int ms)
+{
+    if (shard->rate_armed)
+        return;
 
-    pthread_create(&ddm->oop_pid, NULL, oop_thread, &ddm->iq);
+    oop_gettime(&shard->rate_tv);
+    shard->rate_tv.tv_sec += ms / 1000;
+    shard->rate_tv.tv_usec += ms % 1000 * 1000;
+    if (shard->rate_tv.tv_usec >= 1000000)
+    {
+        shard->rate_tv.tv_sec++;
+        shard->rate_tv.tv_usec -= 1000000;
+    }
+    oop_add_time(oop, shard->rate_tv, rate_release, shard);
+    shard->rate_armed = 1;
+}
 
-    ddm->magic = DDM_LIVE;
+static void wait_rate(oop_source_t *oop, struct dd_shard_t *shard, struct dyndict_t *dd)
+{
+    if (dd->flag & DD_RATE_WAIT)
+        return;
 
-    return ddm;
+    dd->flag |= DD_RATE_WAIT;
+    dd->rate_next = NULL;
+    if (shard->rate_wait_tail == NULL)
+        shard->rate_wait_head = dd;
+    else
+        shard->rate_wait_tail->rate_next = dd;
+    shard->rate_wait_tail = dd;
+    arm_rate(oop, shard, rate_wait(shard->ddm));
 }
 
-// block until del complete
-void ddm_fini(struct dd_manager_t *ddm)
+// 没有等待的dd时不再保留定时器,否则oop无法退出
+static void unwait_rate(oop_source_t *oop, struct dd_shard_t *shard, struct dyndict_t *dd)
 {
-    if (ddm == NULL)
+    if (!(dd->flag & DD_RATE_WAIT))
         return;
 
-    pthread_rwlock_wrlock(&ddm->rwlock);
+    struct dyndict_t **p = &shard->rate_wait_head;
+    struct dyndict_t *prev = NULL;
+    while (*p != dd)
+    {
+        prev = *p;
+        p = &(*p)->rate_next;
+    }
+    *p = dd->rate_next;
+    if (shard->rate_wait_tail == dd)
+        shard->rate_wait_tail = prev;
+    dd->flag &= ~DD_RATE_WAIT;
 
-    ddm->magic = DDM_FINI;
+    if (shard->rate_wait_head == NULL && shard->rate_armed)
+    {
+        oop_remove_time(oop, shard->rate_tv, rate_release, shard);
+        shard->rate_armed = 0;
+    }
+}
 
+// 所有读区间中最早的epoch
+static uint64_t min_epoch(struct dd_manager_t *ddm)
+{
+    uint64_t min = __atomic_load_n(&ddm->epoch, __ATOMIC_SEQ_CST);
     int i;
-    int check_num;
-    struct dyndict_t *dd = NULL;
-    char msg;
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    for (i = 0; i < ddm->reader_num; i++)
     {
-        dd = &ddm->dds[i];
-        // dd->stat == DD_DONE || DD_EMPTY only
-        // or it won't release the lock to let us in
-        if ((dd->stat & DD_STAT) == DD_DONE)
-        {
-            check_num++;
-
-            dd->stat = DD_DEL;
-            pthread_mutex_lock(&ddm->iq.mutex);
+        uint64_t epoch = __atomic_load_n(&ddm->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch != 0 && epoch < min)
+            min = epoch;
+    }
 
-            tq_put(&ddm->iq.tq, dd);
-            msg = CMD_DD;
-            write(ddm->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
+    return min;
+}
 
-            pthread_mutex_unlock(&ddm->iq.mutex);
-        }
-    }
+// 版本i是否还可能被使用
+// ref计数,或者DDM_REF_EPOCH下有读区间在它退休之前进入
+static int dict_busy(struct dyndict_t *dd, int i)
+{
+    if (__atomic_load_n(&dd->count[i], __ATOMIC_SEQ_CST) > 0)
+        return 1;
+    if ((dd->ddm->flags & DDM_REF_EPOCH) && dd->retire[i] > min_epoch(dd->ddm))
+        return 1;
+
+    return 0;
+}
+
+// 之后进入的读区间只会看到新的index
+static void retire_dict(struct dyndict_t *dd, int i)
+{
+    dd->retire[i] = __atomic_add_fetch(&dd->ddm->epoch, 1, __ATOMIC_SEQ_CST);
+}
+
+// 切换到已经加载好的next
+static void publish_dict(struct dyndict_t *dd, int next)
+{
+    int prev = dd->index;
+    pthread_rwlock_wrlock(&dd->rwlock);
+    __atomic_store_n(&dd->index, next, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&dd->version, 1, __ATOMIC_SEQ_CST);
+    pthread_rwlock_unlock(&dd->rwlock);
+    if (prev != next)
+        retire_dict(dd, prev);
+}
+
+// 所有成员都有新版本后一起切换
+static void publish_group(struct dd_group_t *group)
+{
+    if (group->live == 0 || group->staged < group->live)
+        return;
+
+    pthread_rwlock_wrlock(&group->rwlock);
+    int i;
+    for (i = 0; i < group->num; i++)
+    {
+        struct dyndict_t *dd = group->members[i];
+        if (dd->group != group)
+            continue;
+        publish_dict(dd, dd->staged);
+        dd->staged = -1;
+    }
+    group->staged = 0;
+    pthread_rwlock_unlock(&group->rwlock);
+}
+
+// 没有新版本的成员以当前版本参与切换,否则其他成员会一直等待它
+static void stage_current(struct dyndict_t *dd, struct dd_group_t *group)
+{
+    dd->staged = dd->index;
+    group->staged++;
+    publish_group(group);
+}
+
+// watch模式下没有定时的成员只在文件变化时reload
+// 文件没有变化的让它们reload一次,以当前版本参与切换
+static void pull_group(oop_source_t *oop, struct dd_group_t *group)
+{
+    if (group->staged == 0)
+        return;
+
+    int i;
+    for (i = 0; i < group->num; i++)
+    {
+        struct dyndict_t *dd = group->members[i];
+        if (__atomic_load_n(&dd->group, __ATOMIC_ACQUIRE) == group && dd->staged == -1
+                && dd->watch_wd != -1 && dd->intval_s <= 0
+                && !(dd->flag & (DD_WATCH_DIRTY | DD_LOADING | DD_DELETING)))
+            arm_reload(oop, dd, 0);
+    }
+}
+
+// 删除的dd离开group,已经加载的新版本随之丢弃
+static void leave_group(struct dyndict_t *dd)
+{
+    struct dd_group_t *group = dd->group;
+    pthread_rwlock_wrlock(&group->rwlock);
+    group->live--;
+    if (dd->staged != -1)
+    {
+        group->staged--;
+        dd->staged = -1;
+    }
+    __atomic_store_n(&dd->group, NULL, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&group->rwlock);
+
+    publish_group(group);
+}
+
+static int del_dd(oop_source_t *oop, struct dyndict_t *dd);
+static void revoke_pins(struct dd_manager_t *ddm, struct dyndict_t *dd);
+
+// arena_fun的版本可以没有fini_fun,arena最后释放
+static void fini_version(fini_fun_t fini_fun, void *dict, struct dd_arena_t *arena)
+{
+    if (fini_fun != NULL)
+        fini_fun(dict);
+    dd_arena_free(arena);
+}
+
+static void *reclaimer_thread(void *args)
+{
+    struct dd_reclaimer_t *reclaimer = (struct dd_reclaimer_t *)args;
+    // 低优先级,不和加载及读线程抢CPU
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    while (1)
+    {
+        while (reclaimer->head == NULL && !reclaimer->stop)
+            pthread_cond_wait(&reclaimer->cond, &reclaimer->mutex);
+        if (reclaimer->head == NULL)
+            break;
+
+        struct dd_reclaim_node_t *node = reclaimer->head;
+        reclaimer->head = node->next;
+        if (reclaimer->head == NULL)
+            reclaimer->tail = NULL;
+        reclaimer->busy_since = node->since;
+        pthread_mutex_unlock(&reclaimer->mutex);
+
+        uint64_t start = now_ms();
+        fini_version(node->fini_fun, node->dict, node->arena);
+        uint64_t cost = now_ms() - start;
+
+        pthread_mutex_lock(&reclaimer->mutex);
+        reclaimer->pending--;
+        reclaimer->pending_mem -= node->size;
+        reclaimer->reclaimed++;
+        reclaimer->reclaim_ms += cost;
+        reclaimer->busy_since = 0;
+        free(node);
+
+        // 一批释放完之后再归还给系统
+        if (reclaimer->head == NULL && reclaimer->trim)
+        {
+            pthread_mutex_unlock(&reclaimer->mutex);
+            malloc_trim(0);
+            pthread_mutex_lock(&reclaimer->mutex);
+        }
+    }
+    pthread_mutex_unlock(&reclaimer->mutex);
+
+    return NULL;
+}
+
+static struct dd_reclaimer_t *reclaimer_ini(int max, int trim)
+{
+    struct dd_reclaimer_t *reclaimer = (struct dd_reclaimer_t *)calloc(1, sizeof (struct dd_reclaimer_t));
+    if (reclaimer == NULL)
+        return NULL;
+
+    pthread_mutex_init(&reclaimer->mutex, NULL);
+    pthread_cond_init(&reclaimer->cond, NULL);
+    reclaimer->trim = trim;
+    reclaimer->max = max > 0 ? max : DEF_RECLAIM_MAX;
+    if (pthread_create(&reclaimer->pid, NULL, reclaimer_thread, reclaimer) != 0)
+    {
+        pthread_cond_destroy(&reclaimer->cond);
+        pthread_mutex_destroy(&reclaimer->mutex);
+        free(reclaimer);
+        return NULL;
+    }
+
+    return reclaimer;
+}
+
+// 释放完所有等待的版本才退出
+static void reclaimer_fini(struct dd_reclaimer_t *reclaimer)
+{
+    pthread_mutex_lock(&reclaimer->mutex);
+    reclaimer->stop = 1;
+    pthread_cond_signal(&reclaimer->cond);
+    pthread_mutex_unlock(&reclaimer->mutex);
+
+    pthread_join(reclaimer->pid, NULL);
+
+    pthread_cond_destroy(&reclaimer->cond);
+    pthread_mutex_destroy(&reclaimer->mutex);
+    free(reclaimer);
+}
+
+// 释放不再使用的版本,有reclaimer时交给它
+static void free_dict(struct dyndict_t *dd, void *dict, struct dd_arena_t *arena, size_t size)
+{
+    if (dict == NULL || (dd->fini_fun == NULL && arena == NULL))
+        return;
+
+    struct dd_reclaimer_t *reclaimer = dd->ddm->reclaimer;
+    struct dd_reclaim_node_t *node = NULL;
+    if (reclaimer != NULL)
+        node = (struct dd_reclaim_node_t *)malloc(sizeof (struct dd_reclaim_node_t));
+    if (node == NULL)
+    {
+        fini_version(dd->fini_fun, dict, arena);
+        return;
+    }
+
+    node->next = NULL;
+    node->dict = dict;
+    node->fini_fun = dd->fini_fun;
+    node->arena = arena;
+    node->size = size;
+    node->since = now_ms();
+
+    pthread_mutex_lock(&reclaimer->mutex);
+    if (reclaimer->pending >= reclaimer->max)
+    {
+        pthread_mutex_unlock(&reclaimer->mutex);
+        free(node);
+        fini_version(dd->fini_fun, dict, arena);
+        return;
+    }
+    if (reclaimer->tail == NULL)
+        reclaimer->head = node;
+    else
+        reclaimer->tail->next = node;
+    reclaimer->tail = node;
+    reclaimer->pending++;
+    reclaimer->pending_mem += size;
+    pthread_cond_signal(&reclaimer->cond);
+    pthread_mutex_unlock(&reclaimer->mutex);
+}
+
+static void post_job(struct dd_loader_t *loader, struct dd_job_t *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&loader->mutex);
+    if (loader->tail == NULL)
+        loader->head = job;
+    else
+        loader->tail->next = job;
+    loader->tail = job;
+    pthread_cond_signal(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+    loader->jobs++;
+}
+
+// 不在oop线程中时分步加载也一次完成
+static void *stream_all(struct dyndict_t *dd)
+{
+    void *state = dd->begin_fun(dd->ini_args);
+    if (state == NULL)
+        return NULL;
+
+    int r;
+    while ((r = dd->step_fun(state)) > 0)
+        ;
+
+    return dd->finish_fun(state, r == 0);
+}
+
+// 增量加载失败时退回全量加载
+// base是当前版本,加载期间不会被释放,只能读
+static void *build_dict(struct dyndict_t *dd, void *base, int *delta, struct dd_arena_t **arena)
+{
+    void *dict = NULL;
+    *delta = 0;
+    *arena = NULL;
+    if (base != NULL)
+    {
+        dict = dd->delta_fun(base, dd->ini_args);
+        *delta = dict != NULL;
+    }
+    if (dict != NULL)
+        return dict;
+
+    if (dd->arena_fun != NULL)
+    {
+        *arena = dd_arena_new(dd->arena_chunk);
+        if (*arena == NULL)
+            return NULL;
+        dict = dd->arena_fun(dd->ini_args, *arena);
+        if (dict == NULL)
+        {
+            dd_arena_free(*arena);
+            *arena = NULL;
+        }
+    }
+    else
+        dict = dd->begin_fun != NULL ? stream_all(dd) : dd->ini_fun(dd->ini_args);
+
+    return dict;
+}
+
+// 没有size_fun时用arena的大小
+static size_t dict_size(struct dyndict_t *dd, void *dict, struct dd_arena_t *arena)
+{
+    if (dict == NULL)
+        return 0;
+    if (dd->size_fun != NULL)
+        return dd->size_fun(dict);
+
+    return arena != NULL ? dd_arena_size(arena) : 0;
+}
+
+static void *loader_thread(void *args)
+{
+    struct dd_loader_t *loader = (struct dd_loader_t *)args;
+    pthread_mutex_lock(&loader->mutex);
+    while (1)
+    {
+        while (loader->head == NULL && !loader->stop)
+            pthread_cond_wait(&loader->cond, &loader->mutex);
+        if (loader->head == NULL)
+            break;
+
+        struct dd_job_t *job = loader->head;
+        loader->head = job->next;
+        if (loader->head == NULL)
+            loader->tail = NULL;
+        pthread_mutex_unlock(&loader->mutex);
+
+        // 执行期间oop不会访问job和对应的版本
+        struct dyndict_t *dd = job->dd;
+        if (job->type == JOB_LOAD)
+        {
+            if (job->old != NULL)
+                fini_version(dd->fini_fun, job->old, job->old_arena);
+            job->dict = build_dict(dd, job->base, &job->delta, &job->arena);
+            job->size = dict_size(dd, job->dict, job->arena);
+        }
+        else
+        {
+            int i;
+            for (i = 0; i < MAX_DICT_NUM; i++)
+            {
+                if (dd->dicts[i] != NULL)
+                    fini_version(dd->fini_fun, dd->dicts[i], dd->arenas[i]);
+            }
+        }
+
+        pthread_mutex_lock(&loader->mutex);
+        job->next = loader->done;
+        loader->done = job;
+        uint64_t one = 1;
+        write(loader->efd, &one, sizeof (one));
+    }
+    pthread_mutex_unlock(&loader->mutex);
+
+    return NULL;
+}
+
+static struct dd_loader_t *loader_ini(int num, int max_loading)
+{
+    struct dd_loader_t *loader = (struct dd_loader_t *)calloc(1, sizeof (struct dd_loader_t));
+    if (loader == NULL)
+        return NULL;
+    loader->pids = (pthread_t *)calloc(num, sizeof (pthread_t));
+    loader->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (loader->pids == NULL || loader->efd == -1)
+    {
+        if (loader->efd != -1)
+            close(loader->efd);
+        free(loader->pids);
+        free(loader);
+        return NULL;
+    }
+
+    pthread_mutex_init(&loader->mutex, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+    loader->max_loading = max_loading > 0 ? max_loading : num;
+    for (loader->num = 0; loader->num < num; loader->num++)
+        pthread_create(&loader->pids[loader->num], NULL, loader_thread, loader);
+
+    return loader;
+}
+
+// oop线程退出后调用,此时已经没有job
+static void loader_fini(struct dd_loader_t *loader)
+{
+    pthread_mutex_lock(&loader->mutex);
+    loader->stop = 1;
+    pthread_cond_broadcast(&loader->cond);
+    pthread_mutex_unlock(&loader->mutex);
+
+    int i;
+    for (i = 0; i < loader->num; i++)
+        pthread_join(loader->pids[i], NULL);
+
+    pthread_cond_destroy(&loader->cond);
+    pthread_mutex_destroy(&loader->mutex);
+    close(loader->efd);
+    free(loader->pids);
+    free(loader);
+}
+
+// 退出时等待所有job完成,之后oop_run才能返回
+static void loader_check_exit(oop_source_t *oop, struct dd_loader_t *loader)
+{
+    if (loader->exiting && loader->jobs == 0 && loader->active == 0)
+    {
+        oop_remove_fd(oop, loader->efd, OOP_READ);
+        loader->exiting = 0;
+    }
+}
+
+// 按先后顺序等待,避免intval_s很小的dd一直占用
+static void wait_loader(struct dd_loader_t *loader, struct dyndict_t *dd)
+{
+    if (dd->flag & DD_LOAD_WAIT)
+        return;
+
+    dd->flag |= DD_LOAD_WAIT;
+    dd->wait_next = NULL;
+    if (loader->wait_tail == NULL)
+        loader->wait_head = dd;
+    else
+        loader->wait_tail->wait_next = dd;
+    loader->wait_tail = dd;
+}
+
+static void unwait_loader(struct dd_loader_t *loader, struct dyndict_t *dd)
+{
+    if (!(dd->flag & DD_LOAD_WAIT))
+        return;
+
+    struct dyndict_t **p = &loader->wait_head;
+    struct dyndict_t *prev = NULL;
+    while (*p != dd)
+    {
+        prev = *p;
+        p = &(*p)->wait_next;
+    }
+    *p = dd->wait_next;
+    if (loader->wait_tail == dd)
+        loader->wait_tail = prev;
+    dd->flag &= ~DD_LOAD_WAIT;
+}
+
+// 有空闲的加载名额时,重新执行等待中的reload
+// reload不一定需要加载(比如指纹未变),所以要循环
+static void run_waiting(oop_source_t *oop, struct dd_loader_t *loader)
+{
+    struct timeval tv;
+    while (loader->loading < loader->max_loading && loader->wait_head != NULL)
+    {
+        struct dyndict_t *dd = loader->wait_head;
+        unwait_loader(loader, dd);
+        oop_gettime(&tv);
+        reload(oop, tv, dd);
+    }
+}
+
+// 通知等待中的ddm_add/ddm_del,同时带回首次加载是否失败
+// 之后oop还会继续修改flag,ddm_add不能直接读取
+static void notify_done(struct dyndict_t *dd)
+{
+    pthread_mutex_lock(&dd->iq.mutex);
+    dd->done = (dd->flag & DD_LOAD_FAIL) ? -1 : 1;
+    pthread_cond_signal(&dd->done_cond);
+    pthread_mutex_unlock(&dd->iq.mutex);
+}
+
+// 返回-1表示首次加载失败
+static int wait_done(struct dyndict_t *dd)
+{
+    pthread_mutex_lock(&dd->iq.mutex);
+    while (dd->done == 0)
+        pthread_cond_wait(&dd->done_cond, &dd->iq.mutex);
+    int ret = dd->done;
+    dd->done = 0;
+    pthread_mutex_unlock(&dd->iq.mutex);
+
+    return ret;
+}
+
+// 退出时等待所有dd删除完成,之后oop_run才能返回
+static void shard_check_exit(oop_source_t *oop, struct dd_shard_t *shard)
+{
+    if (shard->exiting && shard->listen_num == 0)
+    {
+        oop_remove_fd(oop, shard->ready_efd, OOP_READ);
+        shard->exiting = 0;
+    }
+}
+
+static void listen_dd(struct dyndict_t *dd)
+{
+    dd->flag |= DD_LISTEN;
+    dd->shard->listen_num++;
+}
+
+// 之后就绪队列中的这个dd只清除ready,不再处理
+static void unlisten_dd(oop_source_t *oop, struct dyndict_t *dd)
+{
+    dd->flag &= ~DD_LISTEN;
+    dd->shard->listen_num--;
+    shard_check_exit(oop, dd->shard);
+}
+
+// 加载完成(或失败,dict为NULL)后切换
+static int finish_load(oop_source_t *oop, struct dyndict_t *dd, int next, void *dict, struct dd_arena_t *arena, size_t size, int delta);
+
+// 每次只执行一步,之后的fd和定时器处理完才执行下一步
+// 删除时放弃加载
+static void *load_step(oop_source_t *oop, struct timeval tv, void *args)
+{
+    struct dyndict_t *dd = (struct dyndict_t *)args;
+    int r = (dd->flag & DD_DELETING) ? -1 : dd->step_fun(dd->stream);
+    if (r > 0)
+    {
+        oop_gettime(&dd->step_tv);
+        oop_add_time(oop, dd->step_tv, load_step, dd);
+        return OOP_CONTINUE;
+    }
+
+    void *dict = dd->finish_fun(dd->stream, r == 0);
+    dd->stream = NULL;
+    dd->flag &= ~DD_LOADING;
+    finish_load(oop, dd, dd->job.slot, dict, NULL, dict_size(dd, dict, NULL), 0);
+
+    return OOP_CONTINUE;
+}
+
+// 在oop线程中分步加载,加载期间和pool模式一样是DD_LOADING
+static int stream_dd(oop_source_t *oop, struct dyndict_t *dd, int next)
+{
+    dd->stream = dd->begin_fun(dd->ini_args);
+    if (dd->stream == NULL)
+        return finish_load(oop, dd, next, NULL, NULL, 0, 0);
+
+    dd->flag |= DD_LOADING;
+    dd->job.slot = next;
+    oop_gettime(&dd->step_tv);
+    oop_add_time(oop, dd->step_tv, load_step, dd);
+
+    return 0;
+}
+
+// 开始加载到next,不超过max_loading
+// 返回1表示推迟,0表示已经开始(或同步加载成功),-1表示同步加载失败
+static int load_dd(oop_source_t *oop, struct dyndict_t *dd, int next)
+{
+    struct dd_loader_t *loader = dd->shard->loader;
+    if (loader != NULL && loader->loading >= loader->max_loading)
+    {
+        wait_loader(loader, dd);
+        return 1;
+    }
+
+    dd->flag &= ~DD_WATCH_DIRTY;
+    if (!(dd->flag & DD_LOADED) && dd->finger_fun != NULL)
+        dd->next_finger_ok = dd->finger_fun(dd->ini_args, &dd->next_finger) == 0;
+
+    // 有staged时不会reload,index就是最新的版本
+    void *base = NULL;
+    if (dd->delta_fun != NULL && (dd->flag & DD_LOADED) && dd->delta_num < dd->full_every)
+        base = dd->dicts[dd->index];
+
+    void *old = dd->dicts[next];
+    struct dd_arena_t *old_arena = dd->arenas[next];
+    size_t old_size = dd->sizes[next];
+    __atomic_store_n(&dd->dicts[next], NULL, __ATOMIC_RELEASE);
+    dd->arenas[next] = NULL;
+    __atomic_store_n(&dd->sizes[next], 0, __ATOMIC_RELAXED);
+    // 有reclaimer时loader线程也不再fini
+    if (loader == NULL || dd->ddm->reclaimer != NULL)
+    {
+        free_dict(dd, old, old_arena, old_size);
+        old = NULL;
+        old_arena = NULL;
+    }
+    if (loader == NULL)
+    {
+        // delta失败时同样分步加载,不能在oop中一次完成整个stream
+        if (base != NULL && dd->begin_fun != NULL)
+        {
+            void *dict = dd->delta_fun(base, dd->ini_args);
+            if (dict != NULL)
+                return finish_load(oop, dd, next, dict, NULL, dict_size(dd, dict, NULL), 1);
+            base = NULL;
+        }
+        if (base == NULL && dd->begin_fun != NULL)
+            return stream_dd(oop, dd, next);
+        int delta;
+        struct dd_arena_t *arena;
+        void *dict = build_dict(dd, base, &delta, &arena);
+        return finish_load(oop, dd, next, dict, arena, dict_size(dd, dict, arena), delta);
+    }
+
+    dd->flag |= DD_LOADING;
+    dd->job.dd = dd;
+    dd->job.type = JOB_LOAD;
+    dd->job.slot = next;
+    dd->job.old = old;
+    dd->job.old_arena = old_arena;
+    dd->job.base = base;
+    loader->loading++;
+    post_job(loader, &dd->job);
+
+    return 0;
+}
+
+static int finish_load(oop_source_t *oop, struct dyndict_t *dd, int next, void *dict, struct dd_arena_t *arena, size_t size, int delta)
+{
+    int ret = 0;
+    int first = !(dd->flag & DD_LOADED);
+    __atomic_store_n(&dd->dicts[next], dict, __ATOMIC_RELEASE);
+    dd->arenas[next] = arena;
+    __atomic_store_n(&dd->sizes[next], size, __ATOMIC_RELAXED);
+
+    // 加载期间收到了del,新版本不再使用
+    if (dd->flag & DD_DELETING)
+    {
+        del_dd(oop, dd);
+        return -1;
+    }
+
+    if (dd->dicts[next] == NULL)
+    {
+        dd->flag |= DD_LOAD_FAIL;
+        ret = -1;
+        goto LB_DONE;
+    }
+    __atomic_add_fetch(&dd->loads, 1, __ATOMIC_RELAXED);
+    if (delta)
+    {
+        dd->delta_num++;
+        __atomic_add_fetch(&dd->deltas, 1, __ATOMIC_RELAXED);
+    }
+    else
+        dd->delta_num = 0;
+    // 计算指纹之后数据源又变化的话,下次reload会再加载一次
+    dd->finger = dd->next_finger;
+    dd->finger_ok = dd->next_finger_ok;
+
+    // 首次加载时还不可能属于group
+    struct dd_group_t *group = __atomic_load_n(&dd->group, __ATOMIC_ACQUIRE);
+    if (group != NULL)
+    {
+        dd->staged = next;
+        group->staged++;
+        publish_group(group);
+        pull_group(oop, group);
+    }
+    else
+        publish_dict(dd, next);
+    dd->flag |= DD_LOADED;
+
+LB_DONE:
+    if (first)
+    {
+        if (ret != 0)
+        {
+            // 首次加载失败,不再reload,ddm_add会回收槽位
+            unwatch_dd(dd);
+            unlisten_dd(oop, dd);
+            notify_done(dd);
+            if (dd->shard->loader != NULL)
+                dd->shard->loader->active--;
+            return ret;
+        }
+        notify_done(dd);
+    }
+
+    arm_interval(oop, dd);
+
+    return ret;
+}
+
+static int count_msg(struct dyndict_t *dd);
+
+// 处理已经入队的ref/unref,返回1表示有计数降为0
+// 切换index之前入队的ref只有计数之后,旧版本才不会被当作空闲
+// 只处理开始时已经入队的,之后入队的dd会再次放入就绪队列
+static int drain_msg(struct dyndict_t *dd)
+{
+    pthread_mutex_lock(&dd->iq.mutex);
+    int pending = dd->iq.tq.num;
+    pthread_mutex_unlock(&dd->iq.mutex);
+
+    int wake = 0;
+    while (pending-- > 0)
+    {
+        if (count_msg(dd) == 1)
+            wake = 1;
+    }
+
+    return wake;
+}
+
+static int del_dd(oop_source_t *oop, struct dyndict_t *dd)
+{
+    oop_remove_time(oop, dd->reload_tv, reload, dd);
+    if (dd->shard->loader != NULL)
+        unwait_loader(dd->shard->loader, dd);
+    unwait_rate(oop, dd->shard, dd);
+
+    // DD_DEL之前入队的ref可能还没有处理,先计数,否则可能提前释放
+    drain_msg(dd);
+
+    // 先置wait再检查count,和unref的顺序相反,保证不会丢失唤醒
+    __atomic_store_n(&dd->wait, 1, __ATOMIC_SEQ_CST);
+    int i;
+    int over = 1;
+    struct dd_loader_t *loader = dd->shard->loader;
+    for (i = 0; i < MAX_DICT_NUM; i++)
+    {
+        if (dd->dicts[i] != NULL)
+        {
+            if (dict_busy(dd, i))
+                over = 0;
+            else if (loader == NULL || dd->ddm->reclaimer != NULL)
+            {
+                free_dict(dd, dd->dicts[i], dd->arenas[i], dd->sizes[i]);
+                __atomic_store_n(&dd->dicts[i], NULL, __ATOMIC_RELEASE);
+                dd->arenas[i] = NULL;
+            }
+        }
+    }
+    // 等待加载完成,finish_load会再次调用del_dd
+    if (dd->flag & DD_LOADING)
+        over = 0;
+
+    if (over == 1)
+    {
+        unwatch_dd(dd);
+        unlisten_dd(oop, dd);
+        if (loader != NULL && dd->ddm->reclaimer == NULL)
+        {
+            // 全部版本交给loader释放,完成后才通知ddm_del
+            dd->flag |= DD_LOADING;
+            dd->job.dd = dd;
+            dd->job.type = JOB_FINI;
+            post_job(loader, &dd->job);
+            return -1;
+        }
+        notify_done(dd);
+        if (loader != NULL)
+        {
+            loader->active--;
+            loader_check_exit(oop, loader);
+        }
+        return -1;
+    }
+
+    // 读区间退出时不会通知oop,只能轮询
+    if (dd->ddm->flags & DDM_REF_EPOCH)
+        arm_reload(oop, dd, EPOCH_POLL_MS);
+
+    return 0;
+}
+
+static int find_next_dict(struct dyndict_t *dd);
+
+// 有计数降为0,处理等待中的reload/del
+// 只能加载到非index的空闲词典,index上的计数随时可能增加
+static int check(oop_source_t *oop, struct dyndict_t *dd)
+{
+    if (dd->flag & DD_NEED_RELOAD)
+    {
+        int next = find_next_dict(dd);
+        if (next >= 0 && load_dd(oop, dd, next) == 0)
+        {
+            note_reload(dd->shard);
+            dd->flag &= ~DD_NEED_RELOAD;
+            __atomic_store_n(&dd->need_since, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&dd->wait, 0, __ATOMIC_SEQ_CST);
+        }
+    }
+    else if (dd->flag & DD_DELETING)
+        del_dd(oop, dd);
+
+    return 0;
+}
+
+// 处理队列中的一条ref/unref
+// 返回1表示有计数降为0
+static int count_msg(struct dyndict_t *dd)
+{
+    struct info_msg_t msg;
+    pthread_mutex_lock(&dd->iq.mutex);
+    int ret = tq_get(&dd->iq.tq, &msg);
+    pthread_mutex_unlock(&dd->iq.mutex);
+
+    if (ret != 0 || msg.dict == NULL)
+        return 0;
+
+    int i;
+    for (i = 0; i < MAX_DICT_NUM; i++)
+    {
+        if (msg.dict == dd->dicts[i])
+        {
+            // 只有oop修改,原子操作只是因为ddm_stat会同时读取
+            if (msg.type == DD_REF)
+            {
+                if (__atomic_fetch_add(&dd->count[i], 1, __ATOMIC_RELAXED) == 0)
+                    __atomic_store_n(&dd->hold_since[i], now_ms(), __ATOMIC_RELAXED);
+            }
+            else if (msg.type == DD_UNREF)
+            {
+                if (__atomic_sub_fetch(&dd->count[i], 1, __ATOMIC_RELAXED) == 0)
+                    return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+// 取出就绪队列中所有的dd,处理它们的ref/unref
+// 先清除ready再处理,处理期间的新消息会使dd再次入队,不会丢失
+// reload需要count降为0,DDM_REF_ATOMIC下入队就表示有计数降为0
+static void *in_ready(oop_source_t *oop, int fd, oop_event_t event, void *args)
+{
+    struct dd_shard_t *shard = (struct dd_shard_t *)args;
+    uint64_t n;
+    read(fd, &n, sizeof (n));
+
+    struct dyndict_t *dd = __atomic_exchange_n(&shard->ready_head, NULL, __ATOMIC_ACQUIRE);
+    while (dd != NULL)
+    {
+        struct dyndict_t *next = dd->ready_next;
+        // 已经删除完成的dd,清除ready之后槽位才能被重用,之后不能再访问
+        if (!(dd->flag & DD_LISTEN))
+        {
+            __atomic_store_n(&dd->ready, 0, __ATOMIC_RELEASE);
+            dd = next;
+            continue;
+        }
+
+        __atomic_store_n(&dd->ready, 0, __ATOMIC_SEQ_CST);
+        int wake = drain_msg(dd);
+        if (wake || (dd->ddm->flags & DDM_REF_ATOMIC))
+            check(oop, dd);
+        dd = next;
+    }
+
+    return OOP_CONTINUE;
+}
+
+// 优先重用不在使用中的旧版本,其次才占用空的版本
+// 返回-1表示全部在使用中,-2表示超过mem_cap
+static int find_next_dict(struct dyndict_t *dd)
+{
+    if (!(dd->ddm->flags & DDM_REF_ATOMIC))
+        drain_msg(dd);
+
+    int empty = -1;
+    int resident = 0;
+    size_t mem = 0;
+    int i;
+    for (i = 1; i < dd->dict_num; i++)
+    {
+        int next = (dd->index + i) % dd->dict_num;
+        if (dd->dicts[next] == NULL)
+        {
+            if (empty == -1)
+                empty = next;
+        }
+        else if (!dict_busy(dd, next))
+            return next;
+        else
+        {
+            resident++;
+            mem += dd->sizes[next];
+        }
+    }
+
+    // 新版本的大小按当前版本估计
+    if (empty != -1 && resident > 0 && dd->mem_cap > 0
+            && mem + 2 * dd->sizes[dd->index] > dd->mem_cap)
+        return -2;
+
+    return empty;
+}
+
+
+// 资源正在使用,怎么办?
+// 不进行加载,直到发现空余词典之前,使用旧词典
+static void *reload(oop_source_t *oop, struct timeval tv, void *args)
+{
+    struct dyndict_t *dd = (struct dyndict_t *)args;
+
+    // DDM_REF_EPOCH下等待读区间退出的轮询
+    if (dd->flag & DD_DELETING)
+    {
+        del_dd(oop, dd);
+        return OOP_CONTINUE;
+    }
+
+    // 正在加载,watch模式下稍后再检查这次变化
+    if (dd->flag & DD_LOADING)
+    {
+        if (dd->watch_wd != -1)
+            arm_reload(oop, dd, dd->debounce_ms);
+        return OOP_CONTINUE;
+    }
+
+    // 等待名额期间再次到期(比如watch模式),有名额时会执行
+    if (dd->flag & DD_RATE_WAIT)
+        return OOP_CONTINUE;
+
+    // 在计算指纹之前检查,有名额时再由run_waiting重新执行
+    struct dd_loader_t *loader = dd->shard->loader;
+    if (loader != NULL && loader->loading >= loader->max_loading)
+    {
+        wait_loader(loader, dd);
+        return OOP_CONTINUE;
+    }
+
+    if (!(dd->flag & DD_LOADED))
+    {
+        load_dd(oop, dd, 0);
+        return OOP_CONTINUE;
+    }
+
+    // 上一个版本还在等待group中的其他dd
+    // watch模式下文件的变化不能丢,稍后重试
+    if (dd->staged != -1)
+    {
+        arm_reload(oop, dd, dd->watch_wd != -1 ? dd->debounce_ms : dd->intval_s * 1000);
+        return OOP_CONTINUE;
+    }
+
+    // 没有定时的watch模式,文件没有变化时只可能是pull_group
+    if (dd->watch_wd != -1 && dd->intval_s <= 0 && !(dd->flag & DD_WATCH_DIRTY))
+    {
+        struct dd_group_t *group = __atomic_load_n(&dd->group, __ATOMIC_ACQUIRE);
+        if (group != NULL && group->staged > 0)
+            stage_current(dd, group);
+        return OOP_CONTINUE;
+    }
+
+    // 按先后顺序等待名额,否则周期相同的dd总是先于推迟的dd得到名额
+    // 在计算指纹之前占用名额,推迟时不用重复计算;没有开始加载时归还
+    // rate_running已经由rate_release占用了名额
+    struct dd_shard_t *shard = dd->shard;
+    if (dd->ddm->rate_num > 0 && dd != shard->rate_running
+            && (shard->rate_wait_head != NULL || rate_take(shard) > 0))
+    {
+        __atomic_add_fetch(&shard->reload_deferred, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&dd->defer_rate, 1, __ATOMIC_RELAXED);
+        wait_rate(oop, shard, dd);
+        return OOP_CONTINUE;
+    }
+
+    // 已经在等待空闲版本时不再重复计算(DDM_REF_EPOCH下会轮询)
+    if (dd->finger_fun != NULL && !(dd->flag & DD_NEED_RELOAD))
+    {
+        uint64_t finger;
+        int ok = dd->finger_fun(dd->ini_args, &finger) == 0;
+        if (ok && dd->finger_ok && finger == dd->finger)
+        {
+            rate_cancel(shard);
+            __atomic_add_fetch(&dd->skips, 1, __ATOMIC_RELAXED);
+            // group中已经有成员在等待切换
+            struct dd_group_t *group = __atomic_load_n(&dd->group, __ATOMIC_ACQUIRE);
+            if (group != NULL && group->staged > 0)
+                stage_current(dd, group);
+            arm_interval(oop, dd);
+            return OOP_CONTINUE;
+        }
+        dd->next_finger = finger;
+        dd->next_finger_ok = ok;
+    }
+
+    // 当前使用index,不使用next
+    // 所以无需担心同步问题
+    __atomic_store_n(&dd->wait, 1, __ATOMIC_SEQ_CST);
+    int next = find_next_dict(dd);
+    if (next < 0)
+    {
+        rate_cancel(shard);
+        __atomic_add_fetch(next == -1 ? &dd->defer_busy : &dd->defer_mem, 1, __ATOMIC_RELAXED);
+        dd->flag |= DD_NEED_RELOAD;
+        if (dd->need_since == 0)
+            __atomic_store_n(&dd->need_since, now_ms(), __ATOMIC_RELAXED);
+        if (dd->ddm->flags & DDM_REF_EPOCH)
+            arm_reload(oop, dd, EPOCH_POLL_MS);
+        // 空闲线程缓存的旧版本不会自己释放,wait已经设置,计数归零时check会再次加载
+        if (dd->ddm->flags & DDM_REF_CACHE)
+            revoke_pins(dd->ddm, dd);
+        return OOP_CONTINUE;
+    }
+    __atomic_store_n(&dd->wait, 0, __ATOMIC_SEQ_CST);
+    // DDM_REF_EPOCH下轮询找到了空闲版本
+    dd->flag &= ~DD_NEED_RELOAD;
+    __atomic_store_n(&dd->need_since, 0, __ATOMIC_RELAXED);
+
+    if (load_dd(oop, dd, next) != 1)
+        note_reload(shard);
+    else
+        rate_cancel(shard);
+
+    return OOP_CONTINUE;
+}
+
+// 按先后顺序执行等待名额的reload,直到窗口中的名额再次用完
+// reload不一定需要加载(比如指纹未变),所以要循环
+static void *rate_release(oop_source_t *oop, struct timeval tv, void *args)
+{
+    struct dd_shard_t *shard = (struct dd_shard_t *)args;
+    shard->rate_armed = 0;
+
+    int wait_ms = 0;
+    while (shard->rate_wait_head != NULL && (wait_ms = rate_take(shard)) == 0)
+    {
+        struct dyndict_t *dd = shard->rate_wait_head;
+        unwait_rate(oop, shard, dd);
+        shard->rate_running = dd;
+        reload(oop, tv, dd);
+        shard->rate_running = NULL;
+        // reload在开始加载之前就返回了
+        rate_cancel(shard);
+    }
+    if (shard->rate_wait_head != NULL)
+        arm_rate(oop, shard, wait_ms);
+
+    return OOP_CONTINUE;
+}
+
+// 监听所在目录而不是文件本身,这样rename替换文件也能发现
+static int watch_dd(struct dyndict_t *dd)
+{
+    char dir[PATH_MAX];
+    const char *slash = strrchr(dd->watch_path, '/');
+    if (slash == NULL)
+    {
+        strcpy(dir, ".");
+        dd->watch_name = dd->watch_path;
+    }
+    else
+    {
+        size_t len = slash == dd->watch_path ? 1 : slash - dd->watch_path;
+        if (len >= sizeof (dir))
+            return -1;
+        memcpy(dir, dd->watch_path, len);
+        dir[len] = '\0';
+        dd->watch_name = slash + 1;
+    }
+
+    // 同一目录返回同一个wd
+    struct dd_shard_t *shard = dd->shard;
+    dd->watch_wd = inotify_add_watch(shard->inotify_fd, dir, WATCH_MASK);
+    if (dd->watch_wd == -1)
+        return -1;
+
+    dd->watch_next = shard->watch_head;
+    shard->watch_head = dd;
+
+    return 0;
+}
+
+// 同目录没有其他dd时才能删除wd
+static void unwatch_dd(struct dyndict_t *dd)
+{
+    if (dd->watch_wd == -1)
+        return;
+
+    struct dd_shard_t *shard = dd->shard;
+    struct dyndict_t **p = &shard->watch_head;
+    while (*p != dd)
+        p = &(*p)->watch_next;
+    *p = dd->watch_next;
+    dd->watch_next = NULL;
+
+    // wd只在同一个inotify_fd中共享
+    struct dyndict_t *other;
+    for (other = shard->watch_head; other != NULL; other = other->watch_next)
+    {
+        if (other->watch_wd == dd->watch_wd)
+            break;
+    }
+    if (other == NULL)
+        inotify_rm_watch(shard->inotify_fd, dd->watch_wd);
+    dd->watch_wd = -1;
+}
+
+// 一批写操作只在最后一次之后debounce_ms加载一次,arm_reload会替换之前的定时器
+static void *in_watch(oop_source_t *oop, int fd, oop_event_t event, void *args)
+{
+    struct dd_shard_t *shard = (struct dd_shard_t *)args;
+    char buf[4096] __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof (buf))) > 0)
+    {
+        char *p = buf;
+        while (p < buf + n)
+        {
+            struct inotify_event *e = (struct inotify_event *)p;
+            p += sizeof (struct inotify_event) + e->len;
+
+            struct dyndict_t *dd;
+            for (dd = shard->watch_head; dd != NULL; dd = dd->watch_next)
+            {
+                if (!(dd->flag & DD_LOADED) || (dd->flag & DD_DELETING))
+                    continue;
+                // 事件丢失时全部重新加载
+                if ((e->mask & IN_Q_OVERFLOW)
+                        || (e->wd == dd->watch_wd && e->len > 0 && strcmp(e->name, dd->watch_name) == 0))
+                {
+                    dd->flag |= DD_WATCH_DIRTY;
+                    arm_reload(oop, dd, dd->debounce_ms);
+                }
+            }
+        }
+    }
+
+    return OOP_CONTINUE;
+}
+
+static int add_dd(oop_source_t *oop, struct dyndict_t *dd)
+{
+    __atomic_store_n(&dd->index, 0, __ATOMIC_RELAXED);
+    dd->flag = 0;
+    __atomic_store_n(&dd->wait, 0, __ATOMIC_SEQ_CST);
+    // 旧gen的unref可能还在扫描dicts
+    int i;
+    for (i = 0; i < MAX_DICT_NUM; i++)
+    {
+        __atomic_store_n(&dd->dicts[i], NULL, __ATOMIC_RELEASE);
+        __atomic_store_n(&dd->sizes[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&dd->count[i], 0, __ATOMIC_RELAXED);
+    }
+    memset(dd->arenas, 0, sizeof (dd->arenas));
+    memset(dd->retire, 0, sizeof (dd->retire));
+    dd->staged = -1;
+
+    dd->watch_wd = -1;
+    if (dd->watch_path != NULL && watch_dd(dd) != 0)
+    {
+        // 和首次加载失败相同,ddm_add回收槽位
+        dd->flag |= DD_LOAD_FAIL;
+        notify_done(dd);
+        return -1;
+    }
+
+    listen_dd(dd);
+    arm_reload(oop, dd, 0);
+    if (dd->shard->loader != NULL)
+        dd->shard->loader->active++;
+
+    return 0;
+}
+
+static void *in_loaded(oop_source_t *oop, int fd, oop_event_t event, void *args)
+{
+    struct dd_loader_t *loader = (struct dd_loader_t *)args;
+    uint64_t n;
+    read(fd, &n, sizeof (n));
+
+    pthread_mutex_lock(&loader->mutex);
+    struct dd_job_t *job = loader->done;
+    loader->done = NULL;
+    pthread_mutex_unlock(&loader->mutex);
+
+    while (job != NULL)
+    {
+        struct dd_job_t *next = job->next;
+        struct dyndict_t *dd = job->dd;
+        dd->flag &= ~DD_LOADING;
+        loader->jobs--;
+        if (job->type == JOB_LOAD)
+        {
+            loader->loading--;
+            finish_load(oop, dd, job->slot, job->dict, job->arena, job->size, job->delta);
+            run_waiting(oop, loader);
+        }
+        else
+        {
+            notify_done(dd);
+            loader->active--;
+        }
+        job = next;
+    }
+
+    loader_check_exit(oop, loader);
+
+    return OOP_CONTINUE;
+}
+
+static void *in_notify(oop_source_t *oop, int fd, oop_event_t event, void *args)
+{
+    struct dd_shard_t *shard = (struct dd_shard_t *)args;
+    struct cmd_queue_t *cq = &shard->cq;
+    uint64_t n;
+    read(fd, &n, sizeof (n));
+    __atomic_store_n(&cq->notified, 0, __ATOMIC_SEQ_CST);
+
+    // 一次唤醒处理完所有已入队的命令
+    int cmd;
+    void *data;
+    while (cq_get(cq, &cmd, &data) == 0)
+    {
+        if (cmd == CMD_EXIT)
+        {
+            oop_remove_fd(oop, fd, OOP_READ);
+            oop_remove_fd(oop, shard->inotify_fd, OOP_READ);
+            shard->exiting = 1;
+            shard_check_exit(oop, shard);
+            if (shard->loader != NULL)
+            {
+                shard->loader->exiting = 1;
+                loader_check_exit(oop, shard->loader);
+            }
+            break;
+        }
+        else if (cmd == CMD_DD)
+        {
+            struct dyndict_t *dd = (struct dyndict_t *)data;
+            if (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) == DD_ADD)
+                add_dd(oop, dd);
+            else if (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) == DD_DEL)
+            {
+                // 放弃等待中的reload
+                dd->flag = (dd->flag & (DD_LOADED | DD_LOADING | DD_LOAD_WAIT | DD_RATE_WAIT | DD_LISTEN)) | DD_DELETING;
+                if (dd->group != NULL)
+                    leave_group(dd);
+                retire_dict(dd, dd->index);
+                del_dd(oop, dd);
+            }
+        }
+    }
+
+    return OOP_CONTINUE;
+}
+
+static void release_cache(void *args);
+
+// 线程退出时归还读区间
+static void release_reader(void *args)
+{
+    struct dd_reader_t *reader = (struct dd_reader_t *)args;
+    __atomic_store_n(&reader->epoch, 0, __ATOMIC_SEQ_CST);
+    reader->depth = 0;
+    __atomic_store_n(&reader->used, 0, __ATOMIC_RELEASE);
+}
+
+static void *oop_thread(void *args)
+{
+    struct dd_shard_t *shard = (struct dd_shard_t *)args;
+    struct oop_source_t *oop = NULL;
+    if (shard->ddm->flags & DDM_EPOLL)
+        oop = oop_sys_new_ex(OOP_SYS_EPOLL);
+    // epoll不可用时退回select
+    if (oop == NULL)
+        oop = oop_sys_new();
+
+    oop_add_fd(oop, shard->cq.efd, OOP_READ, in_notify, shard);
+    oop_add_fd(oop, shard->inotify_fd, OOP_READ, in_watch, shard);
+    oop_add_fd(oop, shard->ready_efd, OOP_READ, in_ready, shard);
+    if (shard->loader != NULL)
+        oop_add_fd(oop, shard->loader->efd, OOP_READ, in_loaded, shard->loader);
+
+    oop_run(oop, 0);
+
+    oop_del(oop);
+
+    return NULL;
+}
+
+// oop线程退出后调用,或者还没有创建oop线程
+static void shards_free(struct dd_manager_t *ddm)
+{
+    int i;
+    for (i = 0; i < ddm->shard_num; i++)
+    {
+        struct dd_shard_t *shard = &ddm->shards[i];
+        if (shard->loader != NULL)
+            loader_fini(shard->loader);
+        if (shard->cq.efd != -1)
+            close(shard->cq.efd);
+        if (shard->inotify_fd != -1)
+            close(shard->inotify_fd);
+        if (shard->ready_efd != -1)
+            close(shard->ready_efd);
+    }
+    free(ddm->shards);
+    free(ddm->rate_ring);
+    pthread_mutex_destroy(&ddm->rate_mutex);
+}
+
+// 只初始化,oop线程由ddm_ini_ex最后创建
+static int shards_ini(struct dd_manager_t *ddm, const struct ddm_option_t *opt)
+{
+    int num = opt->shard_num > 0 ? opt->shard_num : 1;
+    // reload_burst的窗口所有shard共用,和shards一起释放
+    ddm->rate_ring = NULL;
+    if (ddm->rate_num > 0)
+    {
+        ddm->rate_ring = (uint64_t *)calloc(ddm->rate_num, sizeof (uint64_t));
+        if (ddm->rate_ring == NULL)
+            return -1;
+    }
+    // cq按cache line对齐
+    if (posix_memalign((void **)&ddm->shards, 64, num * sizeof (struct dd_shard_t)) != 0)
+    {
+        free(ddm->rate_ring);
+        return -1;
+    }
+    pthread_mutex_init(&ddm->rate_mutex, NULL);
+    memset(ddm->shards, 0, num * sizeof (struct dd_shard_t));
+
+    unsigned int seed = (unsigned int)(now_ms() ^ getpid());
+    int i;
+    for (i = 0; i < num; i++)
+    {
+        struct dd_shard_t *shard = &ddm->shards[i];
+        shard->ddm = ddm;
+        shard->id = i;
+        shard->rand_seed = seed + i;
+        cq_ini(&shard->cq);
+        shard->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        shard->ready_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        shard->rate_slot = -1;
+        if (opt->loader_num > 0)
+            shard->loader = loader_ini(opt->loader_num, opt->max_loading);
+
+        if (shard->cq.efd == -1 || shard->inotify_fd == -1 || shard->ready_efd == -1
+                || (opt->loader_num > 0 && shard->loader == NULL))
+        {
+            ddm->shard_num = i + 1;
+            shards_free(ddm);
+            return -1;
+        }
+    }
+    ddm->shard_num = num;
+
+    return 0;
+}
+
+struct dd_manager_t *ddm_ini(int max_num)
+{
+    struct ddm_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.max_num = max_num;
+
+    return ddm_ini_ex(&opt);
+}
+
+struct dd_manager_t *ddm_ini_ex(const struct ddm_option_t *opt)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)malloc(sizeof (struct dd_manager_t));
+    if (ddm == NULL)
+        return NULL;
+
+    int max_num = opt->max_num;
+    if (max_num <= 0)
+        max_num = DEF_DD_NUM;
+    ddm->dds = (struct dyndict_t *)calloc(max_num, sizeof (struct dyndict_t));
+    if (ddm->dds == NULL)
+    {
+        free(ddm);
+        return NULL;
+    }
+
+    ddm->rate_num = opt->reload_burst > 0 ? opt->reload_burst : 0;
+    ddm->rate_window_ms = opt->reload_window_ms > 0 ? opt->reload_window_ms : DEF_RELOAD_WINDOW_MS;
+    ddm->rate_head = 0;
+    ddm->burst_since = 0;
+    ddm->burst = 0;
+    ddm->max_burst = 0;
+    ddm->phase_period_ms = opt->phase_period_ms > 0 ? opt->phase_period_ms : DEF_PHASE_PERIOD_MS;
+
+    // 锁和dd槽位同生命周期,add/del不再反复初始化
+    int i;
+    for (i = 0; i < max_num; i++)
+    {
+        ddm->dds[i].ddm = ddm;
+        ddm->dds[i].watch_wd = -1;
+        pthread_rwlock_init(&ddm->dds[i].rwlock, NULL);
+        pthread_mutex_init(&ddm->dds[i].iq.mutex, NULL);
+        pthread_cond_init(&ddm->dds[i].done_cond, NULL);
+    }
+
+    // 装载率不超过1/2
+    uint32_t size = 1;
+    while (size < 2 * (uint32_t)max_num)
+        size <<= 1;
+    ddm->index = (int *)malloc(size * sizeof (int));
+    if (ddm->index == NULL)
+    {
+        free(ddm->dds);
+        free(ddm);
+        return NULL;
+    }
+    memset(ddm->index, -1, size * sizeof (int));
+    ddm->index_mask = size - 1;
+
+    ddm->max = max_num;
+    ddm->num = 0;
+    ddm->flags = opt->flags;
+    // 读区间之外的ddm_ref/unref使用原子计数
+    // 缓存的版本也是用原子计数pin住的
+    if (ddm->flags & (DDM_REF_EPOCH | DDM_REF_CACHE))
+        ddm->flags |= DDM_REF_ATOMIC;
+    ddm->caches = NULL;
+    if (ddm->flags & DDM_REF_CACHE)
+    {
+        pthread_key_create(&ddm->cache_key, release_cache);
+        pthread_mutex_init(&ddm->cache_mutex, NULL);
+    }
+
+    ddm->groups = NULL;
+
+    ddm->epoch = 1;
+    ddm->readers = NULL;
+    ddm->reader_num = 0;
+    if (ddm->flags & DDM_REF_EPOCH)
+    {
+        ddm->reader_num = opt->reader_num > 0 ? opt->reader_num : DEF_READER_NUM;
+        if (posix_memalign((void **)&ddm->readers, sizeof (struct dd_reader_t),
+                    ddm->reader_num * sizeof (struct dd_reader_t)) != 0)
+        {
+            free(ddm->index);
+            free(ddm->dds);
+            free(ddm);
+            return NULL;
+        }
+        memset(ddm->readers, 0, ddm->reader_num * sizeof (struct dd_reader_t));
+        pthread_key_create(&ddm->reader_key, release_reader);
+    }
+
+    ddm->reclaimer = NULL;
+    if (opt->reclaim)
+        ddm->reclaimer = reclaimer_ini(opt->reclaim_max, opt->reclaim_trim);
+    if ((opt->reclaim && ddm->reclaimer == NULL) || shards_ini(ddm, opt) != 0)
+    {
+        if (ddm->reclaimer != NULL)
+            reclaimer_fini(ddm->reclaimer);
+        if (ddm->readers != NULL)
+        {
+            pthread_key_delete(ddm->reader_key);
+            free(ddm->readers);
+        }
+        if (ddm->flags & DDM_REF_CACHE)
+        {
+            pthread_key_delete(ddm->cache_key);
+            pthread_mutex_destroy(&ddm->cache_mutex);
+        }
+        free(ddm->index);
+        free(ddm->dds);
+        free(ddm);
+        return NULL;
+    }
+
+    // 读线程多时读锁几乎一直被持有,默认的读优先会使add/del一直等待
+    // 持有ddm读锁时不会再次加读锁,所以可以写优先
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&ddm->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    for (i = 0; i < ddm->shard_num; i++)
+        pthread_create(&ddm->shards[i].oop_pid, NULL, oop_thread, &ddm->shards[i]);
+
+    ddm->magic = DDM_LIVE;
+
+    return ddm;
+}
+
+// block until del complete
+void ddm_fini(struct dd_manager_t *ddm)
+{
+    if (ddm == NULL)
+        return;
+
+    pthread_rwlock_wrlock(&ddm->rwlock);
+
+    ddm->magic = DDM_FINI;
+
+    int i;
+    int check_num;
+    struct dyndict_t *dd = NULL;
+    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    {
+        dd = &ddm->dds[i];
+        // dd->stat == DD_DONE || DD_EMPTY only
+        // or it won't release the lock to let us in
+        if ((__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) == DD_DONE)
+        {
+            check_num++;
+
+            pthread_rwlock_wrlock(&dd->rwlock);
+            __atomic_store_n(&dd->stat, DD_DEL, __ATOMIC_SEQ_CST);
+            __atomic_add_fetch(&dd->version, 1, __ATOMIC_SEQ_CST);
+            pthread_rwlock_unlock(&dd->rwlock);
+
+            // fini不能失败,队列满时等待oop取走
+            while (cq_put(&dd->shard->cq, CMD_DD, dd) != 0)
+                sched_yield();
+        }
+    }
 
     // CMD_EXIT is not CMD_DD
     // CMD_DD used in ddm_del, since we need to delete all dict
-    // not care about dd->oop2dd, since we just close them
-    // might cause a problem when it blocks
-    pthread_mutex_lock(&ddm->iq.mutex);
-    msg = CMD_EXIT;
-    write(ddm->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
-    pthread_mutex_unlock(&ddm->iq.mutex);
+    // not wait for dd->done, oop_thread exits after all dds are deleted
+    for (i = 0; i < ddm->shard_num; i++)
+    {
+        while (cq_put(&ddm->shards[i].cq, CMD_EXIT, NULL) != 0)
+            sched_yield();
+    }
+
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    // 空闲线程的pin不取走的话,del永远无法完成
+    if (ddm->flags & DDM_REF_CACHE)
+    {
+        for (i = 0; i < ddm->max; i++)
+            revoke_pins(ddm, &ddm->dds[i]);
+    }
+
+    // just wait for oop_thread exit
+    // can't lock since unref might use ddm->rwlock
+    for (i = 0; i < ddm->shard_num; i++)
+        pthread_join(ddm->shards[i].oop_pid, NULL);
+    shards_free(ddm);
+    if (ddm->reclaimer != NULL)
+        reclaimer_fini(ddm->reclaimer);
+
+    for (i = 0; i < ddm->max; i++)
+    {
+        pthread_rwlock_destroy(&ddm->dds[i].rwlock);
+        pthread_mutex_destroy(&ddm->dds[i].iq.mutex);
+        pthread_cond_destroy(&ddm->dds[i].done_cond);
+        free(ddm->dds[i].iq.tq.data);
+    }
+    free(ddm->dds);
+    free(ddm->index);
+    if (ddm->readers != NULL)
+    {
+        pthread_key_delete(ddm->reader_key);
+        free(ddm->readers);
+    }
+    if (ddm->flags & DDM_REF_CACHE)
+    {
+        // 还没有退出的线程不会再调用release_cache
+        pthread_key_delete(ddm->cache_key);
+        while (ddm->caches != NULL)
+        {
+            struct dd_cache_t *cache = ddm->caches;
+            ddm->caches = cache->next;
+            free(cache);
+        }
+        pthread_mutex_destroy(&ddm->cache_mutex);
+    }
+
+    while (ddm->groups != NULL)
+    {
+        struct dd_group_t *group = ddm->groups;
+        ddm->groups = group->next;
+        pthread_rwlock_destroy(&group->rwlock);
+        free(group->members);
+        free(group);
+    }
+
+    pthread_rwlock_destroy(&ddm->rwlock);
+    ddm->magic = DDM_DEAD;
+    free(ddm);
+}
+
+// load dict: dict = ini_fun(ini_filename);
+// rem  dict: fini(dict);
+
+// add:
+// block until add is DD_DONE of DD_FAIL
+// dict map to uniq slot in dds
+int ddm_add(struct dd_manager_t *ddm, const char *name, int intval_s, void *(*ini_fun)(void *), void *ini_args, void (*fini_fun)(void *))
+{
+    struct dd_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.intval_s = intval_s;
+
+    return ddm_add_ex(ddm, name, ini_fun, ini_args, fini_fun, &opt);
+}
+
+int ddm_add_ex(struct dd_manager_t *ddm, const char *name, void *(*ini_fun)(void *), void *ini_args, void (*fini_fun)(void *), const struct dd_option_t *opt)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE || opt == NULL)
+        return DDM_MEM;
+
+    int dict_num = opt->version_num > 0 ? opt->version_num : DEF_DICT_NUM;
+    if (dict_num < 2 || dict_num > MAX_DICT_NUM)
+        return DDM_OVERFLOW;
+    // 增量和分步加载的版本不在arena中
+    if (opt->arena_fun != NULL && (opt->delta_fun != NULL || opt->begin_fun != NULL))
+        return DDM_UNIMPLEMENTED;
+
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_wrlock(&ddm->rwlock);
+
+    if (ddm->magic != DDM_LIVE)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_MEM;
+    }
+
+    if (ddm->num == ddm->max)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_OVERFLOW;
+    }
+
+    // 正在add/del的同名dd也算重复
+    if (index_find(ddm, name, hash) != NULL)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_DUP;
+    }
+
+    // 还在就绪队列中的槽位要等oop取出之后才能重用
+    int i;
+    struct dyndict_t *target = NULL;
+    for (i = 0; i < ddm->max; i++)
+    {
+        if (__atomic_load_n(&ddm->dds[i].stat, __ATOMIC_SEQ_CST) == DD_EMPTY && !__atomic_load_n(&ddm->dds[i].ready, __ATOMIC_ACQUIRE))
+        {
+            target = &ddm->dds[i];
+            break;
+        }
+    }
+    if (target == NULL)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_OVERFLOW;
+    }
+
+    ddm->num++;
+    __atomic_store_n(&target->stat, DD_ADD, __ATOMIC_SEQ_CST);
+    target->name = name;
+    target->hash = hash;
+    index_insert(ddm, target);
+
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    target->ini_fun = ini_fun;
+    target->ini_args = ini_args;
+    target->fini_fun = fini_fun;
+    target->arena_fun = opt->arena_fun;
+    target->arena_chunk = opt->arena_chunk;
+    target->intval_s = opt->intval_s;
+    target->watch_path = opt->watch_path;
+    target->debounce_ms = opt->debounce_ms > 0 ? opt->debounce_ms : DEF_DEBOUNCE_MS;
+    target->dict_num = dict_num;
+    target->mem_cap = opt->mem_cap;
+    target->size_fun = opt->size_fun;
+    target->finger_fun = opt->finger_fun;
+    target->finger_ok = 0;
+    target->next_finger_ok = 0;
+    target->begin_fun = opt->begin_fun;
+    target->step_fun = opt->step_fun;
+    target->finish_fun = opt->finish_fun;
+    target->stream = NULL;
+    target->delta_fun = opt->delta_fun;
+    target->full_every = opt->full_every > 0 ? opt->full_every : DEF_FULL_EVERY;
+    target->delta_num = 0;
+    target->deltas = 0;
+    target->defer_rate = 0;
+    target->jitter_ms = opt->jitter_ms > 0 ? opt->jitter_ms : 0;
+    // 只在[0, intval_s)中选,相位超过一个周期没有意义
+    target->phase_ms = opt->phase_ms > 0 ? opt->phase_ms : 0;
+    if (opt->phase_ms == DDM_PHASE_AUTO && opt->intval_s > 0)
+        target->phase_ms = hash % ((uint32_t)opt->intval_s * 1000);
+    target->phase_pending = target->phase_ms > 0;
+    if (opt->shard > 0)
+        target->shard = &ddm->shards[(opt->shard - 1) % ddm->shard_num];
+    else
+        target->shard = &ddm->shards[hash % ddm->shard_num];
+    target->loads = 0;
+    target->skips = 0;
+    target->defer_busy = 0;
+    target->defer_mem = 0;
+    target->need_since = 0;
+
+    // 槽位第一次使用时分配,之后一直保留到ddm_fini
+    if (!(ddm->flags & DDM_REF_ATOMIC) && target->iq.tq.data == NULL)
+    {
+        target->iq.tq.data = (struct info_msg_t *)malloc(MAX_QUEUE_SIZE * sizeof (struct info_msg_t));
+        if (target->iq.tq.data == NULL)
+        {
+            release_dd(ddm, target);
+            return DDM_MEM;
+        }
+    }
+
+    // 删除之前没有处理的消息直接丢弃
+    target->iq.tq.head = target->iq.tq.tail = 0;
+    target->iq.tq.num = 0;
+    target->done = 0;
+
+    if (cq_put(&target->shard->cq, CMD_DD, target) != 0)
+    {
+        release_dd(ddm, target);
+        return DDM_OVERFLOW;
+    }
+
+    if (wait_done(target) < 0)
+    {
+        release_dd(ddm, target);
+        return DDM_MEM;
+    }
+    else
+    {
+        // 加载期间ref/handle已经可以通过名字找到这个dd
+        __atomic_store_n(&target->stat, DD_DONE, __ATOMIC_SEQ_CST);
+        return DDM_OK;
+    }
+}
+
+// 最后一个成员的del完成时oop已经不再访问group
+// ddm_ref_group/ddm_unref_group持有ddm读锁,在写锁下释放
+static void put_group(struct dd_manager_t *ddm, struct dd_group_t *group)
+{
+    pthread_rwlock_wrlock(&ddm->rwlock);
+    if (--group->remain == 0)
+    {
+        struct dd_group_t **p;
+        for (p = &ddm->groups; *p != group; p = &(*p)->next)
+            ;
+        *p = group->next;
+        pthread_rwlock_destroy(&group->rwlock);
+        free(group->members);
+        free(group);
+    }
+    pthread_rwlock_unlock(&ddm->rwlock);
+}
+
+// group为发送del时dd所属的group
+static int del_dd_from_ddm(struct dd_manager_t *ddm, struct dyndict_t *dd, struct dd_group_t *group)
+{
+    wait_done(dd);
+    release_dd(ddm, dd);
+    if (group != NULL)
+        put_group(ddm, group);
+
+    return 0;
+}
+
+int ddm_del(struct dd_manager_t *ddm, const char *name)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return DDM_MEM;
+
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_wrlock(&ddm->rwlock);
+
+    if (ddm->magic != DDM_LIVE)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_MEM;
+    }
+
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    if (dd == NULL || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_NODICT;
+    }
+
+    // oop处理del时会清除dd->group
+    struct dd_group_t *group = dd->group;
+    pthread_rwlock_wrlock(&dd->rwlock);
+    __atomic_store_n(&dd->stat, DD_DEL, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&dd->version, 1, __ATOMIC_SEQ_CST);
+    if (cq_put(&dd->shard->cq, CMD_DD, dd) != 0)
+    {
+        // oop看不到这次del,恢复原状态
+        __atomic_store_n(&dd->stat, DD_DONE, __ATOMIC_SEQ_CST);
+        pthread_rwlock_unlock(&dd->rwlock);
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_OVERFLOW;
+    }
+    pthread_rwlock_unlock(&dd->rwlock);
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    // version已经改变,使用中的pin在unref时释放
+    if (ddm->flags & DDM_REF_CACHE)
+        revoke_pins(ddm, dd);
+
+    // 完成后由del_dd_from_ddm置为DD_EMPTY
+    del_dd_from_ddm(ddm, dd, group);
+
+    return DDM_OK;
+}
+
+// 字段由oop修改,这里只是读取一个近似的快照
+int ddm_stat(struct dd_manager_t *ddm, const char *name, struct dd_stat_t *stat)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE || stat == NULL)
+        return DDM_MEM;
+
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_rdlock(&ddm->rwlock);
+
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    if (dd == NULL || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+    {
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_NODICT;
+    }
+
+    memset(stat, 0, sizeof (*stat));
+    stat->version_num = dd->dict_num;
+    stat->index = __atomic_load_n(&dd->index, __ATOMIC_RELAXED);
+    uint64_t now = now_ms();
+    int i;
+    for (i = 0; i < dd->dict_num; i++)
+    {
+        if (__atomic_load_n(&dd->dicts[i], __ATOMIC_RELAXED) != NULL)
+        {
+            stat->resident++;
+            stat->mem += __atomic_load_n(&dd->sizes[i], __ATOMIC_RELAXED);
+        }
+
+        stat->refs[i] = __atomic_load_n(&dd->count[i], __ATOMIC_RELAXED);
+        if (stat->refs[i] > 0)
+        {
+            uint64_t since = __atomic_load_n(&dd->hold_since[i], __ATOMIC_RELAXED);
+            stat->hold_ms[i] = since != 0 && now > since ? now - since : 0;
+            if (i != stat->index && stat->hold_ms[i] > stat->stale_hold_ms)
+                stat->stale_hold_ms = stat->hold_ms[i];
+        }
+    }
+
+    uint64_t need_since = __atomic_load_n(&dd->need_since, __ATOMIC_RELAXED);
+    if (need_since != 0 && now > need_since)
+        stat->reload_wait_ms = now - need_since;
+    stat->loads = __atomic_load_n(&dd->loads, __ATOMIC_RELAXED);
+    stat->defer_busy = __atomic_load_n(&dd->defer_busy, __ATOMIC_RELAXED);
+    stat->defer_mem = __atomic_load_n(&dd->defer_mem, __ATOMIC_RELAXED);
+    stat->skips = __atomic_load_n(&dd->skips, __ATOMIC_RELAXED);
+    stat->deltas = __atomic_load_n(&dd->deltas, __ATOMIC_RELAXED);
+    stat->defer_rate = __atomic_load_n(&dd->defer_rate, __ATOMIC_RELAXED);
 
     pthread_rwlock_unlock(&ddm->rwlock);
 
-    // just wait for oop_thread exit
-    // can't lock since unref might use ddm->rwlock
-    pthread_join(ddm->oop_pid, NULL);
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    return DDM_OK;
+}
+
+int ddm_reclaim_stat(struct dd_manager_t *ddm, struct ddm_reclaim_stat_t *stat)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return DDM_MEM;
+
+    struct dd_reclaimer_t *reclaimer = ddm->reclaimer;
+    if (reclaimer == NULL)
+        return DDM_UNIMPLEMENTED;
+
+    uint64_t now = now_ms();
+    pthread_mutex_lock(&reclaimer->mutex);
+    stat->pending = reclaimer->pending;
+    stat->pending_mem = reclaimer->pending_mem;
+    stat->reclaimed = reclaimer->reclaimed;
+    stat->reclaim_ms = reclaimer->reclaim_ms;
+    uint64_t since = reclaimer->busy_since;
+    if (since == 0 && reclaimer->head != NULL)
+        since = reclaimer->head->since;
+    pthread_mutex_unlock(&reclaimer->mutex);
+    stat->oldest_ms = since != 0 && now > since ? now - since : 0;
+
+    return DDM_OK;
+}
+
+// 字段由oop修改,和ddm_stat一样只是近似的快照
+int ddm_reload_stat(struct dd_manager_t *ddm, struct ddm_reload_stat_t *stat)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE || stat == NULL)
+        return DDM_MEM;
+
+    // 各shard的计数相加,burst的窗口是所有shard共用的
+    memset(stat, 0, sizeof (*stat));
+    stat->phase_period_ms = ddm->phase_period_ms;
+    stat->max_burst = __atomic_load_n(&ddm->max_burst, __ATOMIC_RELAXED);
+    int i, j;
+    for (i = 0; i < ddm->shard_num; i++)
+    {
+        struct dd_shard_t *shard = &ddm->shards[i];
+        stat->started += __atomic_load_n(&shard->reload_starts, __ATOMIC_RELAXED);
+        stat->deferred += __atomic_load_n(&shard->reload_deferred, __ATOMIC_RELAXED);
+        for (j = 0; j < DDM_PHASE_BUCKETS; j++)
+            stat->phase[j] += __atomic_load_n(&shard->phases[j], __ATOMIC_RELAXED);
+    }
+
+    return DDM_OK;
+}
+
+// 唤醒dd所在shard的oop,已经在就绪队列中时什么也不做
+// 调用者持有dd读锁并确认不是DD_EMPTY,DD_EMPTY之后ready不会再被置1
+static void ready_dd(struct dyndict_t *dd)
+{
+    if (__atomic_exchange_n(&dd->ready, 1, __ATOMIC_SEQ_CST))
+        return;
+
+    struct dd_shard_t *shard = dd->shard;
+    struct dyndict_t *head = __atomic_load_n(&shard->ready_head, __ATOMIC_RELAXED);
+    do
+        dd->ready_next = head;
+    while (!__atomic_compare_exchange_n(&shard->ready_head, &head, dd, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    // 队列原来不为空时,放入第一个dd的一方已经(或即将)写过eventfd
+    if (head == NULL)
+    {
+        uint64_t n = 1;
+        write(shard->ready_efd, &n, sizeof (n));
+    }
+}
+
+// 只有入队成功才唤醒oop
+static int put_msg(struct dyndict_t *dd, void *dict, char msg)
+{
+    pthread_mutex_lock(&dd->iq.mutex);
+    int ret = tq_put(&dd->iq.tq, dict, msg);
+    pthread_mutex_unlock(&dd->iq.mutex);
+    if (ret == 0)
+        ready_dd(dd);
+
+    return ret;
+}
+
+// gen为ref时dd的gen
+static void unref_atomic(struct dyndict_t *dd, uint32_t gen, int index)
+{
+    if (__atomic_sub_fetch(&dd->count[index], 1, __ATOMIC_SEQ_CST) == 0
+            && __atomic_load_n(&dd->wait, __ATOMIC_SEQ_CST))
+    {
+        // 计数归零后del可能完成,槽位随即被ddm_add重用
+        // DD_EMPTY和gen在dd写锁下一起改变,gen未变说明还是同一个dd
+        pthread_rwlock_rdlock(&dd->rwlock);
+        if (__atomic_load_n(&dd->gen, __ATOMIC_SEQ_CST) == gen)
+            ready_dd(dd);
+        pthread_rwlock_unlock(&dd->rwlock);
+    }
+}
+
+// 先加计数再确认index未变,和load_dd先改index再检查计数的顺序相反
+// 因此要么oop看到计数,要么这里看到新的index重试
+// gen/stat同理,要么del看到计数,要么这里看到DD_DEL放弃
+static void *ref_atomic(struct dyndict_t *dd, uint32_t gen, int *pindex)
+{
+    // 已经删除的dd不再修改计数,避免反复唤醒oop
+    if (__atomic_load_n(&dd->gen, __ATOMIC_SEQ_CST) != gen
+            || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+        return NULL;
+
+    int index;
+    while (1)
+    {
+        index = __atomic_load_n(&dd->index, __ATOMIC_SEQ_CST);
+        if (__atomic_add_fetch(&dd->count[index], 1, __ATOMIC_SEQ_CST) == 1)
+            __atomic_store_n(&dd->hold_since[index], now_ms(), __ATOMIC_RELAXED);
+        if (__atomic_load_n(&dd->gen, __ATOMIC_SEQ_CST) != gen
+                || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+        {
+            unref_atomic(dd, gen, index);
+            return NULL;
+        }
+        if (__atomic_load_n(&dd->index, __ATOMIC_SEQ_CST) == index)
+        {
+            if (pindex != NULL)
+                *pindex = index;
+            return __atomic_load_n(&dd->dicts[index], __ATOMIC_ACQUIRE);
+        }
+        unref_atomic(dd, gen, index);
+    }
+}
+
+static struct dd_cache_t *get_cache(struct dd_manager_t *ddm)
+{
+    struct dd_cache_t *cache = (struct dd_cache_t *)pthread_getspecific(ddm->cache_key);
+    if (cache == NULL)
+    {
+        cache = (struct dd_cache_t *)malloc(sizeof (struct dd_cache_t) + ddm->max * sizeof (struct dd_cache_entry_t));
+        if (cache == NULL)
+            return NULL;
+        cache->ddm = ddm;
+        int i;
+        for (i = 0; i < ddm->max; i++)
+        {
+            cache->entries[i].dict = NULL;
+            cache->entries[i].local = -1;
+        }
+        pthread_setspecific(ddm->cache_key, cache);
+
+        pthread_mutex_lock(&ddm->cache_mutex);
+        cache->next = ddm->caches;
+        ddm->caches = cache;
+        pthread_mutex_unlock(&ddm->cache_mutex);
+    }
+
+    return cache;
+}
+
+// 取得空闲的pin,返回1时由调用者unref
+// 和其他线程的revoke_pins竞争,只有一方能把0改为-1
+static int take_pin(struct dd_cache_entry_t *entry)
+{
+    int local = 0;
+    return __atomic_compare_exchange_n(&entry->local, &local, -1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+// 释放本线程没有在使用的pin,force时(线程退出)全部释放
+static void flush_cache(struct dd_cache_t *cache, int force)
+{
+    int i;
+    for (i = 0; i < cache->ddm->max; i++)
+    {
+        struct dd_cache_entry_t *entry = &cache->entries[i];
+        int pinned = force ? __atomic_exchange_n(&entry->local, -1, __ATOMIC_SEQ_CST) >= 0 : take_pin(entry);
+        if (pinned)
+            unref_atomic(&cache->ddm->dds[i], entry->gen, entry->index);
+    }
+}
+
+static void release_cache(void *args)
+{
+    struct dd_cache_t *cache = (struct dd_cache_t *)args;
+    struct dd_manager_t *ddm = cache->ddm;
+    pthread_mutex_lock(&ddm->cache_mutex);
+    struct dd_cache_t **p;
+    for (p = &ddm->caches; *p != cache; p = &(*p)->next)
+        ;
+    *p = cache->next;
+    pthread_mutex_unlock(&ddm->cache_mutex);
+
+    flush_cache(cache, 1);
+    free(cache);
+}
+
+// 取走所有线程对dd的空闲pin,线程下次ref时重新pin
+// 空闲线程不再ref时,它的pin会一直阻塞reload和ddm_del/ddm_fini
+static void revoke_pins(struct dd_manager_t *ddm, struct dyndict_t *dd)
+{
+    pthread_mutex_lock(&ddm->cache_mutex);
+    struct dd_cache_t *cache;
+    for (cache = ddm->caches; cache != NULL; cache = cache->next)
+    {
+        struct dd_cache_entry_t *entry = &cache->entries[dd - ddm->dds];
+        int local = 0;
+        if (__atomic_compare_exchange_n(&entry->local, &local, -2, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        {
+            uint32_t gen = entry->gen;
+            int index = entry->index;
+            __atomic_store_n(&entry->local, -1, __ATOMIC_SEQ_CST);
+            unref_atomic(dd, gen, index);
+        }
+    }
+    pthread_mutex_unlock(&ddm->cache_mutex);
+}
+
+// 释放本线程对dd不在使用中的pin
+static void drop_cached(struct dd_manager_t *ddm, struct dyndict_t *dd)
+{
+    struct dd_cache_t *cache = (struct dd_cache_t *)pthread_getspecific(ddm->cache_key);
+    if (cache == NULL)
+        return;
+
+    struct dd_cache_entry_t *entry = &cache->entries[dd - ddm->dds];
+    if (take_pin(entry))
+        unref_atomic(dd, entry->gen, entry->index);
+}
+
+// version未变时直接返回缓存的版本,不修改任何共享数据
+// 先读version再pin,记录的version不会比pin住的版本新
+static void *ref_cached(struct dd_manager_t *ddm, struct dyndict_t *dd, uint32_t gen)
+{
+    struct dd_cache_t *cache = get_cache(ddm);
+    if (cache == NULL)
+        return ref_atomic(dd, gen, NULL);
+
+    struct dd_cache_entry_t *entry = &cache->entries[dd - ddm->dds];
+    uint32_t version = __atomic_load_n(&dd->version, __ATOMIC_ACQUIRE);
+    int local = __atomic_load_n(&entry->local, __ATOMIC_SEQ_CST);
+    // 为0时pin可能同时被revoke_pins取走
+    if (local >= 0 && entry->gen == gen && entry->version == version
+            && __atomic_compare_exchange_n(&entry->local, &local, local + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return entry->dict;
+
+    // 本线程还在使用旧版本,新版本不缓存
+    if (local > 0)
+        return ref_atomic(dd, gen, NULL);
+
+    if (take_pin(entry))
+        unref_atomic(dd, entry->gen, entry->index);
+    // 等待revoke_pins读完旧的字段
+    while (__atomic_load_n(&entry->local, __ATOMIC_SEQ_CST) == -2)
+        sched_yield();
+
+    int index;
+    void *dict = ref_atomic(dd, gen, &index);
+    if (dict == NULL)
+        return NULL;
+
+    // local为-1时其他线程不会读取这些字段
+    entry->dict = dict;
+    entry->index = index;
+    entry->gen = gen;
+    entry->version = version;
+    __atomic_store_n(&entry->local, 1, __ATOMIC_SEQ_CST);
+
+    return dict;
+}
+
+// 非原子模式下尝试一次入队,队列满时置full
+// ddm_del在dd写锁下设置DD_DEL,之前的ref都已入队
+// 队列满时调用者要先放开oop需要的锁(dd/group)再重试
+static void *ref_queue(struct dyndict_t *dd, uint32_t gen, int *full)
+{
+    void *dict = NULL;
+    *full = 0;
+    pthread_rwlock_rdlock(&dd->rwlock);
+    if (dd->gen == gen && (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) == DD_DONE)
+    {
+        dict = __atomic_load_n(&dd->dicts[__atomic_load_n(&dd->index, __ATOMIC_ACQUIRE)], __ATOMIC_ACQUIRE);
+        *full = put_msg(dd, dict, DD_REF) != 0;
+        if (*full)
+            dict = NULL;
+    }
+    pthread_rwlock_unlock(&dd->rwlock);
+
+    return dict;
+}
+
+// name和handle接口共用,gen用于发现dd已经被删除(或槽位被重用)
+static void *ref_dd(struct dd_manager_t *ddm, struct dyndict_t *dd, uint32_t gen)
+{
+    if (ddm->flags & DDM_REF_CACHE)
+        return ref_cached(ddm, dd, gen);
+    if (ddm->flags & DDM_REF_ATOMIC)
+        return ref_atomic(dd, gen, NULL);
+
+    void *dict;
+    int full;
+    while ((dict = ref_queue(dd, gen, &full)) == NULL && full)
+        sched_yield();
+
+    return dict;
+}
+
+// del需要等待unref完成,所以DD_DEL也要能unref
+static int unref_dd(struct dd_manager_t *ddm, struct dyndict_t *dd, uint32_t gen, void *dict)
+{
+    if (ddm->flags & DDM_REF_CACHE)
+    {
+        // pin留给下次ref,除非版本已经改变(reload或ddm_del)
+        // 先减local再读version,和revoke_pins之前修改version的顺序相反
+        // 因此要么这里看到新的version,要么revoke_pins看到local为0
+        struct dd_cache_t *cache = (struct dd_cache_t *)pthread_getspecific(ddm->cache_key);
+        struct dd_cache_entry_t *entry = cache == NULL ? NULL : &cache->entries[dd - ddm->dds];
+        if (entry != NULL && __atomic_load_n(&entry->local, __ATOMIC_SEQ_CST) > 0 && entry->dict == dict && entry->gen == gen)
+        {
+            if (__atomic_sub_fetch(&entry->local, 1, __ATOMIC_SEQ_CST) == 0
+                    && __atomic_load_n(&dd->version, __ATOMIC_SEQ_CST) != entry->version
+                    && take_pin(entry))
+                unref_atomic(dd, entry->gen, entry->index);
+            return DDM_OK;
+        }
+    }
+
+    if (ddm->flags & DDM_REF_ATOMIC)
+    {
+        if (__atomic_load_n(&dd->gen, __ATOMIC_SEQ_CST) != gen)
+            return DDM_NODICT;
+
+        // 持有dict的引用,对应的槽位不会被重新加载
+        int i;
+        for (i = 0; i < MAX_DICT_NUM; i++)
+        {
+            if (__atomic_load_n(&dd->dicts[i], __ATOMIC_ACQUIRE) == dict)
+                break;
+        }
+
+        if (i == MAX_DICT_NUM)
+            return DDM_NODICT;
+
+        unref_atomic(dd, gen, i);
+        return DDM_OK;
+    }
+
+    // 丢失unref会使计数无法归零,队列满时只能等待
+    int ret;
+    int full;
+    do
     {
-        dd = &ddm->dds[i];
-        if ((dd->stat & DD_STAT) == DD_DEL)
+        ret = DDM_NODICT;
+        full = 0;
+        pthread_rwlock_rdlock(&dd->rwlock);
+        int stat = __atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT;
+        if (dd->gen == gen && (stat == DD_DONE || stat == DD_DEL))
         {
-            check_num++;
-
-            close(dd->oop2dd[PIPE_READ]);
-            close(dd->oop2dd[PIPE_WRITE]);
-            pthread_rwlock_destroy(&dd->rwlock);
-
-            close(dd->iq.pipefd[PIPE_READ]);
-            close(dd->iq.pipefd[PIPE_WRITE]);
-            pthread_mutex_destroy(&dd->iq.mutex);
+            full = put_msg(dd, dict, DD_UNREF);
+            ret = DDM_OK;
         }
-    }
+        pthread_rwlock_unlock(&dd->rwlock);
+        if (full)
+            sched_yield();
+    } while (full);
 
-    pthread_rwlock_destroy(&ddm->rwlock);
-    ddm->magic = DDM_DEAD;
-    free(ddm);
+    return ret;
 }
 
-// load dict: dict = ini_fun(ini_filename);
-// rem  dict: fini(dict);
-
-// add:
-// block until add is DD_DONE of DD_FAIL
-// dict map to uniq slot in dds
-int ddm_add(struct dd_manager_t *ddm, const char *name, int intval_s, void *(*ini_fun)(void *), void *ini_args, void (*fini_fun)(void *))
+// ddm_ref和ddm_get共用,*pdd为找到的dd
+static void *ref_name(struct dd_manager_t *ddm, const char *name, struct dyndict_t **pdd)
 {
     if (ddm == NULL || ddm->magic != DDM_LIVE)
-        return DDM_MEM;
+        return NULL;
 
-    pthread_rwlock_wrlock(&ddm->rwlock);
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_rdlock(&ddm->rwlock);
 
     if (ddm->magic != DDM_LIVE)
     {
         pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_MEM;
+        return NULL;
     }
 
-    if (ddm->num == ddm->max)
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    if (dd == NULL || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
     {
+        // 正在删除,pin不释放的话del无法完成
+        if (dd != NULL && (ddm->flags & DDM_REF_CACHE))
+            drop_cached(ddm, dd);
         pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_OVERFLOW;
-    }
-
-    int i;
-    int check_num;
-    struct dyndict_t *target = NULL;
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
-    {
-        struct dyndict_t *dd = &ddm->dds[i];
-        if (dd->stat == DD_EMPTY && target == NULL)
-            target = dd;
-        else if ((dd->stat & DD_STAT) == DD_DONE)
-        {
-            check_num++;
-            if (strcmp(dd->name, name) == 0)
-            {
-                pthread_rwlock_unlock(&ddm->rwlock);
-                return DDM_DUP;
-            }
-        }
+        return NULL;
     }
 
-    if (target == NULL)
-        target = &ddm->dds[check_num];
-
-    ddm->num++;
-    target->stat = DD_ADD;
-
+    // ref_dd会通过gen重新确认,无需继续持有ddm读锁
+    uint32_t gen = dd->gen;
     pthread_rwlock_unlock(&ddm->rwlock);
 
-    target->name = name;
-    target->ini_fun = ini_fun;
-    target->ini_args = ini_args;
-    target->fini_fun = fini_fun;
-    target->intval_s = intval_s;
-
-    pipe(target->oop2dd);
-    pipe(target->iq.pipefd);
+    *pdd = dd;
+    return ref_dd(ddm, dd, gen);
+}
 
-    char msg;
+void *ddm_ref(struct dd_manager_t *ddm, const char *name)
+{
+    struct dyndict_t *dd;
+    return ref_name(ddm, name, &dd);
+}
 
-    pthread_mutex_lock(&ddm->iq.mutex);
-    tq_put(&ddm->iq.tq, target);
-    msg = CMD_DD;
-    write(ddm->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
-    pthread_mutex_unlock(&ddm->iq.mutex);
+// unref 可以在DD_FINI下操作,因为fini需要unref来减少索引
+// 以便可以安全的删除词典索引
+int ddm_unref(struct dd_manager_t *ddm, const char *name, void *dict)
+{
+    if (ddm == NULL || ddm->magic == DDM_DEAD)
+        return DDM_MEM;
 
-    while (read(target->oop2dd[PIPE_READ], &msg, sizeof (char)))
-    {
-        if (msg == CMD_DD)
-            break;
-    }
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_rdlock(&ddm->rwlock);
 
-    if (target->stat & DD_LOAD_FAIL)
+    if (ddm->magic == DDM_DEAD)
     {
-        close(target->oop2dd[PIPE_READ]);
-        close(target->oop2dd[PIPE_WRITE]);
-        close(target->iq.pipefd[PIPE_READ]);
-        close(target->iq.pipefd[PIPE_WRITE]);
-        target->stat = DD_FAIL;
+        pthread_rwlock_unlock(&ddm->rwlock);
         return DDM_MEM;
     }
-    else
+
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    if (dd == NULL)
     {
-        pthread_rwlock_init(&target->rwlock, NULL);
-        pthread_mutex_init(&target->iq.mutex, NULL);
-        target->iq.tq.head = target->iq.tq.tail = 0;
-        target->iq.tq.num = 0;
-        target->stat = DD_DONE;
-        return DDM_OK;
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_NODICT;
     }
+
+    uint32_t gen = dd->gen;
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    return unref_dd(ddm, dd, gen, dict);
 }
 
-static int del_dd_from_ddm(struct dd_manager_t *ddm, struct dyndict_t *dd)
+int ddm_handle(struct dd_manager_t *ddm, const char *name, struct dd_handle_t *handle)
 {
-    char msg;
-    pthread_mutex_lock(&ddm->iq.mutex);
-
-    tq_put(&ddm->iq.tq, dd);
-    msg = CMD_DD;
-    write(ddm->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return DDM_MEM;
 
-    pthread_mutex_unlock(&ddm->iq.mutex);
+    uint32_t hash = dd_hash(name);
+    pthread_rwlock_rdlock(&ddm->rwlock);
 
-    while (read(dd->oop2dd[PIPE_READ], &msg, sizeof (char)))
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    if (dd == NULL || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
     {
-        if (msg == CMD_DD)
-            break;
+        pthread_rwlock_unlock(&ddm->rwlock);
+        return DDM_NODICT;
     }
 
-    close(dd->oop2dd[PIPE_READ]);
-    close(dd->oop2dd[PIPE_WRITE]);
-    pthread_rwlock_destroy(&dd->rwlock);
-    pthread_mutex_destroy(&dd->iq.mutex);
-    close(dd->iq.pipefd[PIPE_READ]);
-    close(dd->iq.pipefd[PIPE_WRITE]);
-    return 0;
+    handle->slot = dd - ddm->dds;
+    handle->gen = dd->gen;
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    return DDM_OK;
 }
 
-int ddm_del(struct dd_manager_t *ddm, const char *name)
+void *ddm_ref_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle)
 {
     if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return NULL;
+
+    if (handle->slot < 0 || handle->slot >= ddm->max)
+        return NULL;
+
+    return ref_dd(ddm, &ddm->dds[handle->slot], handle->gen);
+}
+
+int ddm_unref_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle, void *dict)
+{
+    if (ddm == NULL || ddm->magic == DDM_DEAD)
         return DDM_MEM;
-    pthread_rwlock_wrlock(&ddm->rwlock);
 
-    if (ddm->magic != DDM_LIVE)
+    if (handle->slot < 0 || handle->slot >= ddm->max)
+        return DDM_NODICT;
+
+    return unref_dd(ddm, &ddm->dds[handle->slot], handle->gen, dict);
+}
+
+// 在ref和unref之间复制,返回后value不再依赖dict的版本
+// 持有ref时槽位不会被重用,fini_fun和gen都是dict所属的dd的
+static int copy_kv(struct dyndict_t *dd, void *dict, const char *key, size_t klen, char *val, size_t *vlen)
+{
+    if (dd->fini_fun != dd_kv_fini)
+        return DDM_TYPE;
+
+    const char *v;
+    size_t len;
+    if (dd_kv_get((const struct dd_kv_t *)dict, key, klen, &v, &len) != DDM_OK)
+        return DDM_NODICT;
+
+    int ret = DDM_OVERFLOW;
+    if (len < *vlen)
     {
-        pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_MEM;
+        memcpy(val, v, len + 1);
+        ret = DDM_OK;
     }
+    *vlen = len;
 
-    if (ddm->num == 0)
-    {
-        pthread_rwlock_unlock(&ddm->rwlock);
+    return ret;
+}
+
+int ddm_get(struct dd_manager_t *ddm, const char *name, const char *key, size_t klen, char *val, size_t *vlen)
+{
+    struct dyndict_t *dd;
+    void *dict = ref_name(ddm, name, &dd);
+    if (dict == NULL)
         return DDM_NODICT;
-    }
 
-    int i;
-    int check_num;
-    struct dyndict_t *dd = NULL;
-    int found = 0;
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    int ret = copy_kv(dd, dict, key, klen, val, vlen);
+    unref_dd(ddm, dd, dd->gen, dict);
+
+    return ret;
+}
+
+int ddm_get_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle, const char *key, size_t klen, char *val, size_t *vlen)
+{
+    void *dict = ddm_ref_h(ddm, handle);
+    if (dict == NULL)
+        return DDM_NODICT;
+
+    int ret = copy_kv(&ddm->dds[handle->slot], dict, key, klen, val, vlen);
+    ddm_unref_h(ddm, handle, dict);
+
+    return ret;
+}
+
+void ddm_cache_flush(struct dd_manager_t *ddm)
+{
+    if (ddm == NULL || !(ddm->flags & DDM_REF_CACHE))
+        return;
+
+    struct dd_cache_t *cache = (struct dd_cache_t *)pthread_getspecific(ddm->cache_key);
+    if (cache != NULL)
+        flush_cache(cache, 0);
+}
+
+// 读区间可以嵌套,只有最外层发布epoch
+int ddm_read_enter(struct dd_manager_t *ddm)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return DDM_MEM;
+
+    if (!(ddm->flags & DDM_REF_EPOCH))
+        return DDM_UNIMPLEMENTED;
+
+    struct dd_reader_t *reader = (struct dd_reader_t *)pthread_getspecific(ddm->reader_key);
+    if (reader == NULL)
     {
-        dd = &ddm->dds[i];
-        if ((dd->stat & DD_STAT) == DD_DONE)
+        int i;
+        for (i = 0; i < ddm->reader_num; i++)
         {
-            check_num++;
-            if (strcmp(dd->name, name) == 0)
+            int unused = 0;
+            if (__atomic_compare_exchange_n(&ddm->readers[i].used, &unused, 1, 0,
+                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
             {
-                found = 1;
+                reader = &ddm->readers[i];
                 break;
             }
         }
-    }
 
-    if (found == 0)
-    {
-        pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_NODICT;
+        if (reader == NULL)
+            return DDM_OVERFLOW;
+        pthread_setspecific(ddm->reader_key, reader);
     }
 
-    dd->stat = DD_DEL;
-    pthread_rwlock_unlock(&ddm->rwlock);
+    // 先发布epoch,再读取index,和load_dd先改index再推进epoch的顺序相反
+    if (reader->depth++ == 0)
+        __atomic_store_n(&reader->epoch, __atomic_load_n(&ddm->epoch, __ATOMIC_SEQ_CST), __ATOMIC_SEQ_CST);
 
-    del_dd_from_ddm(ddm, dd);
+    return DDM_OK;
+}
 
-    dd->stat = DD_EMPTY;
+void ddm_read_exit(struct dd_manager_t *ddm)
+{
+    if (ddm == NULL || !(ddm->flags & DDM_REF_EPOCH))
+        return;
 
-    return DDM_OK;
+    struct dd_reader_t *reader = (struct dd_reader_t *)pthread_getspecific(ddm->reader_key);
+    if (reader == NULL || reader->depth == 0)
+        return;
+
+    if (--reader->depth == 0)
+        __atomic_store_n(&reader->epoch, 0, __ATOMIC_RELEASE);
 }
 
+static void *read_dd(struct dyndict_t *dd, uint32_t gen)
+{
+    if (__atomic_load_n(&dd->gen, __ATOMIC_SEQ_CST) != gen
+            || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+        return NULL;
 
-void *ddm_ref(struct dd_manager_t *ddm, const char *name)
+    return __atomic_load_n(&dd->dicts[__atomic_load_n(&dd->index, __ATOMIC_SEQ_CST)], __ATOMIC_ACQUIRE);
+}
+
+void *ddm_read(struct dd_manager_t *ddm, const char *name)
 {
-    if (ddm == NULL || ddm->magic != DDM_LIVE)
+    if (ddm == NULL || ddm->magic != DDM_LIVE || !(ddm->flags & DDM_REF_EPOCH))
         return NULL;
 
+    uint32_t hash = dd_hash(name);
     pthread_rwlock_rdlock(&ddm->rwlock);
+    struct dyndict_t *dd = index_find(ddm, name, hash);
+    void *dict = dd == NULL ? NULL : read_dd(dd, dd->gen);
+    pthread_rwlock_unlock(&ddm->rwlock);
 
-    if (ddm->magic != DDM_LIVE)
-    {
-        pthread_rwlock_unlock(&ddm->rwlock);
+    return dict;
+}
+
+void *ddm_read_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE || !(ddm->flags & DDM_REF_EPOCH))
+        return NULL;
+
+    if (handle->slot < 0 || handle->slot >= ddm->max)
         return NULL;
+
+    return read_dd(&ddm->dds[handle->slot], handle->gen);
+}
+
+static struct dd_group_t *find_group(struct dd_manager_t *ddm, const char *name)
+{
+    struct dd_group_t *group;
+    for (group = ddm->groups; group != NULL; group = group->next)
+    {
+        if (strcmp(group->name, name) == 0)
+            return group;
     }
 
-    if (ddm->num == 0)
+    return NULL;
+}
+
+// 成员必须已经加载完成,且不属于其他group
+int ddm_group_add(struct dd_manager_t *ddm, const char *group_name, const char **names, int num)
+{
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
+        return DDM_MEM;
+
+    if (num <= 0)
+        return DDM_NODICT;
+
+    struct dd_group_t *group = (struct dd_group_t *)malloc(sizeof (struct dd_group_t));
+    if (group == NULL)
+        return DDM_MEM;
+    group->members = (struct dyndict_t **)malloc(num * sizeof (struct dyndict_t *));
+    if (group->members == NULL)
     {
-        pthread_rwlock_unlock(&ddm->rwlock);
-        return NULL;
+        free(group);
+        return DDM_MEM;
     }
+    group->name = group_name;
+    group->num = num;
+    group->live = num;
+    group->remain = num;
+    group->staged = 0;
+
+    pthread_rwlock_wrlock(&ddm->rwlock);
+
+    int ret = DDM_OK;
+    if (ddm->magic != DDM_LIVE)
+        ret = DDM_MEM;
+    else if (find_group(ddm, group_name) != NULL)
+        ret = DDM_DUP;
 
     int i;
-    int check_num;
-    struct dyndict_t *dd = NULL;
-    int found = 0;
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    for (i = 0; ret == DDM_OK && i < num; i++)
     {
-        dd = &ddm->dds[i];
-        if ((dd->stat & DD_STAT) == DD_DONE)
+        struct dyndict_t *dd = index_find(ddm, names[i], dd_hash(names[i]));
+        if (dd == NULL || (__atomic_load_n(&dd->stat, __ATOMIC_SEQ_CST) & DD_STAT) != DD_DONE)
+            ret = DDM_NODICT;
+        else if (dd->group != NULL)
+            ret = DDM_DUP;
+        // 切换由成员所在shard的oop完成,group的状态只能由一个oop修改
+        else if (i > 0 && dd->shard != group->members[0]->shard)
+            ret = DDM_UNIMPLEMENTED;
+        else
         {
-            check_num++;
-            if (strcmp(dd->name, name) == 0)
-            {
-                found = 1;
-                break;
-            }
+            int j;
+            for (j = 0; j < i && group->members[j] != dd; j++)
+                ;
+            if (j < i)
+                ret = DDM_DUP;
+            group->members[i] = dd;
         }
     }
 
-    if (found == 0)
+    if (ret != DDM_OK)
     {
         pthread_rwlock_unlock(&ddm->rwlock);
-        return NULL;
+        free(group->members);
+        free(group);
+        return ret;
     }
 
-    void *dict;
-    char msg;
-    pthread_rwlock_rdlock(&dd->rwlock);
-    pthread_rwlock_unlock(&ddm->rwlock);
-
-    dict = dd->dicts[dd->index];
-    pthread_mutex_lock(&dd->iq.mutex);
-    tq_put(&dd->iq.tq, dict);
-    msg = DD_REF;
-    write(dd->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
-    pthread_mutex_unlock(&dd->iq.mutex);
+    pthread_rwlock_init(&group->rwlock, NULL);
+    group->next = ddm->groups;
+    ddm->groups = group;
+    // oop在下一次加载时开始按group切换
+    for (i = 0; i < num; i++)
+        __atomic_store_n(&group->members[i]->group, group, __ATOMIC_RELEASE);
 
-    pthread_rwlock_unlock(&dd->rwlock);
+    pthread_rwlock_unlock(&ddm->rwlock);
 
-    return dict;
+    return DDM_OK;
 }
 
-// unref 可以在DD_FINI下操作,因为fini需要unref来减少索引
-// 以便可以安全的删除词典索引
-int ddm_unref(struct dd_manager_t *ddm, const char *name, void *dict)
+// 在group读锁下逐个ref,切换无法插入其中,得到的是同一次切换后的版本
+// 返回成员数,dicts按ddm_group_add时names的顺序,已删除的成员为NULL
+int ddm_ref_group(struct dd_manager_t *ddm, const char *group_name, void **dicts, int num)
 {
-    if (ddm == NULL || ddm->magic == DDM_DEAD)
+    if (ddm == NULL || ddm->magic != DDM_LIVE)
         return DDM_MEM;
 
+    int ret;
+    int full;
+    int i;
+LB_RETRY:
     pthread_rwlock_rdlock(&ddm->rwlock);
 
-    if (ddm->magic == DDM_DEAD)
+    struct dd_group_t *group = find_group(ddm, group_name);
+    if (group == NULL)
     {
         pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_MEM;
+        return DDM_NODICT;
     }
 
-    if (ddm->num == 0)
+    full = 0;
+    pthread_rwlock_rdlock(&group->rwlock);
+    ret = group->num;
+    if (ret > num)
+        ret = DDM_OVERFLOW;
+
+    for (i = 0; ret >= 0 && i < group->num; i++)
     {
-        pthread_rwlock_unlock(&ddm->rwlock);
-        return DDM_NODICT;
+        struct dyndict_t *dd = group->members[i];
+        if (dd->group != group)
+        {
+            // 成员正在删除,pin不释放的话del无法完成
+            if (ddm->flags & DDM_REF_CACHE)
+                drop_cached(ddm, dd);
+            dicts[i] = NULL;
+        }
+        else if (ddm->flags & DDM_REF_ATOMIC)
+            dicts[i] = ref_dd(ddm, dd, dd->gen);
+        else if ((dicts[i] = ref_queue(dd, dd->gen, &full)) == NULL && full)
+            break;
     }
 
-    int i;
-    int check_num;
-    struct dyndict_t *dd = NULL;
-    int found = 0;
-    for (i = 0, check_num = 0; i < ddm->max && check_num < ddm->num; i++)
+    pthread_rwlock_unlock(&group->rwlock);
+
+    if (full)
     {
-        dd = &ddm->dds[i];
-        int stat = dd->stat & DD_STAT;
-        if (stat == DD_DONE || (stat == DD_DEL && ddm->magic == DDM_FINI))
+        // 持有group读锁时oop无法切换,不能在这里等待队列,放弃已经取得的重来
+        int j;
+        for (j = 0; j < i; j++)
         {
-            check_num++;
-            if (strcmp(dd->name, name) == 0)
-            {
-                found = 1;
-                break;
-            }
+            struct dyndict_t *dd = group->members[j];
+            if (dicts[j] != NULL)
+                unref_dd(ddm, dd, dd->gen, dicts[j]);
         }
+        pthread_rwlock_unlock(&ddm->rwlock);
+        sched_yield();
+        goto LB_RETRY;
     }
 
-    if (found == 0)
+    pthread_rwlock_unlock(&ddm->rwlock);
+
+    return ret;
+}
+
+int ddm_unref_group(struct dd_manager_t *ddm, const char *group_name, void **dicts, int num)
+{
+    if (ddm == NULL || ddm->magic == DDM_DEAD)
+        return DDM_MEM;
+
+    pthread_rwlock_rdlock(&ddm->rwlock);
+
+    struct dd_group_t *group = find_group(ddm, group_name);
+    if (group == NULL)
     {
         pthread_rwlock_unlock(&ddm->rwlock);
         return DDM_NODICT;
     }
 
-    char msg;
+    // 成员在ref之后被删除时,del会等待这里的unref,gen不会改变
+    // members创建后不再改变,不需要group锁;unref可能等待队列,也不能持有
+    int ret = DDM_OK;
+    int i;
+    if (num > group->num)
+        num = group->num;
+    for (i = 0; i < num; i++)
+    {
+        struct dyndict_t *dd = group->members[i];
+        if (dicts[i] != NULL && unref_dd(ddm, dd, dd->gen, dicts[i]) != DDM_OK)
+            ret = DDM_NODICT;
+    }
     pthread_rwlock_unlock(&ddm->rwlock);
 
-    pthread_mutex_lock(&dd->iq.mutex);
-    tq_put(&dd->iq.tq, dict);
-    msg = DD_UNREF;
-    write(dd->iq.pipefd[PIPE_WRITE], &msg, sizeof (char));
-    pthread_mutex_unlock(&dd->iq.mutex);
-
-    return DDM_OK;
+    return ret;
 }
-
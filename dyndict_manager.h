@@ -1,6 +1,9 @@
 #ifndef _DYNDICT_MANAGER_H
 #define _DYNDICT_MANAGER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -12,18 +15,197 @@ extern "C" {
 #define DDM_DUP -4
 #define DDM_UNIMPLEMENTED -5
 #define DDM_UNKNOWN -6
+// ddm_get的dd不是dd_kv词典
+#define DDM_TYPE -7
+
+// ddm_ini_ex flags
+// ref/unref直接原子修改对应版本的计数,不经过oop的消息队列
+// 只有在计数降为0且有等待的reload/del时才唤醒oop
+#define DDM_REF_ATOMIC 0x1
+// 以读区间(ddm_read_enter/exit)为单位的epoch回收,区间内ddm_read不修改任何共享数据
+// 旧版本在所有早于它退休的读区间退出后才会被重新加载
+// 隐含DDM_REF_ATOMIC
+#define DDM_REF_EPOCH 0x2
+// 每个线程缓存ref过的版本并持有一个计数(pin),版本未变时ref/unref不修改任何共享数据
+// 版本改变(重新加载或开始删除)后的下一次ref/unref释放pin
+// 空闲线程的pin由ddm_del/ddm_fini和因此推迟的reload取走,ddm_cache_flush可以提前释放
+// 隐含DDM_REF_ATOMIC
+#define DDM_REF_CACHE 0x4
+// oop使用epoll代替select,只处理就绪的fd,fd也不受FD_SETSIZE(1024)的限制
+// dd不占用fd,每个shard只有几个;进程打开的fd很多(编号超过FD_SETSIZE)时应该使用
+#define DDM_EPOLL 0x8
+
+// 值为0的字段使用默认值
+struct ddm_option_t
+{
+    int max_num;
+    int flags;
+    // DDM_REF_EPOCH下同时使用读区间的最大线程数
+    int reader_num;
+    // 大于0时ini_fun/fini_fun由这些loader线程执行,oop线程只负责切换
+    // 为0时在oop线程中加载,加载期间oop不能处理其他dd
+    int loader_num;
+    // 同时加载的dd数上限,限制加载时的内存峰值,默认为loader_num
+    int max_loading;
+    // 非0时不再使用的版本交给一个低优先级的reclaimer线程fini,ddm_del返回时可能还没有fini
+    // 积压超过reclaim_max(默认64)个版本时,在原来的线程fini
+    // reclaim_trim非0时每释放完一批调用malloc_trim,把内存归还给系统
+    int reclaim;
+    int reclaim_max;
+    int reclaim_trim;
+    // 大于0时任意reload_window_ms(默认1000)内最多开始reload_burst次reload(不包括首次加载),所有shard合计
+    // 超过的reload推迟到窗口中最早的一次过期,避免大量dd同时reload造成的CPU/IO/内存尖峰
+    int reload_burst;
+    int reload_window_ms;
+    // ddm_reload_stat中相位分布的周期,默认60000
+    int phase_period_ms;
+    // oop线程数,默认1,dd按名字的hash(或dd_option_t的shard)分配给其中一个
+    // 每个shard有自己的控制队列,定时器,inotify和loader,不同shard的dd的ref/unref消息和加载互不阻塞
+    // loader_num和max_loading是每个shard的,reload_burst是所有shard共用的
+    int shard_num;
+};
+
+// 每个dd最多同时驻留的版本数
+#define DDM_MAX_VERSION_NUM 8
+
+// dd_option_t的phase_ms,由名字的hash在[0, intval_s)中选一个相位
+#define DDM_PHASE_AUTO -1
+
+struct dd_arena_t;
+
+// ddm_add_ex的参数,值为0的字段使用默认值
+struct dd_option_t
+{
+    int intval_s;
+    // 同时驻留的版本数,默认2(当前版本+一个备用)
+    // 旧版本还在使用时,reload可以加载到其他空闲版本而不用等待
+    int version_num;
+    // 驻留版本的总大小超过mem_cap后,不再占用新的版本,需要size_fun
+    // 至少会保留两个版本
+    size_t mem_cap;
+    size_t (*size_fun)(void *dict);
+    // watch模式,watch_path(通常就是ini_args)被写入关闭,rename替换或touch后重新加载
+    // 连续的变化只在最后一次之后debounce_ms(默认200)加载一次
+    // 此时intval_s>0才会额外定时reload
+    const char *watch_path;
+    int debounce_ms;
+    // 到期的reload先计算数据源的指纹(参数为ini_args),和当前版本加载时相同就跳过
+    // 返回非0表示无法计算,照常加载
+    int (*finger_fun)(void *ini_args, uint64_t *finger);
+    // 增量加载,在当前版本cur上应用数据源的变化(比如追加写的patch文件),返回新的版本
+    // cur不能修改,新版本不能和cur共享需要fini的数据,返回NULL时改为全量加载(ini_fun)
+    // 已经应用到哪里需要记录在版本中,比如patch文件的偏移
+    // 连续增量加载full_every(默认16)次后全量加载一次,之后才可以压缩patch
+    void *(*delta_fun)(void *cur, void *ini_args);
+    int full_every;
+    // 分步加载,设置时代替ini_fun(可以为NULL)
+    // begin_fun返回加载的状态,NULL表示失败;step_fun每次处理一块数据(比如读一块文件并建立索引),
+    // 返回大于0表示还有,0表示完成,小于0表示失败;finish_fun释放状态,ok时返回新的版本
+    // 没有loader线程时oop每轮只执行一步,加载期间仍然可以处理ref/unref和控制命令
+    void *(*begin_fun)(void *ini_args);
+    int (*step_fun)(void *state);
+    void *(*finish_fun)(void *state, int ok);
+    // 设置时代替ini_fun,版本的内存从arena中分配(dd_arena.h),版本退休时fini_fun(可以为NULL)之后整体释放
+    // 不同版本的内存不会交错,释放时也不用逐个free;arena_chunk为0时使用DD_ARENA_CHUNK
+    // 没有size_fun时版本大小为arena映射的大小;不能和delta_fun/begin_fun一起使用(DDM_UNIMPLEMENTED)
+    void *(*arena_fun)(void *ini_args, struct dd_arena_t *arena);
+    size_t arena_chunk;
+    // 错开同时添加的dd的定时reload:第一次定时reload额外推迟phase_ms(或DDM_PHASE_AUTO)
+    // 之后每次定时reload额外推迟[0, jitter_ms]中的随机时间
+    int phase_ms;
+    int jitter_ms;
+    // 大于0时放在第(shard - 1) % shard_num个shard,而不是按名字的hash
+    // 同一个group的dd必须在同一个shard
+    int shard;
+};
+
+// ddm_stat的结果
+struct dd_stat_t
+{
+    int version_num;
+    int resident;
+    // 驻留版本的总大小,没有size_fun时为0
+    size_t mem;
+    uint64_t loads;
+    // 到期的reload因为没有空闲版本(全部在使用中)或者mem_cap被推迟的次数
+    uint64_t defer_busy;
+    uint64_t defer_mem;
+    // 指纹未变跳过的reload次数
+    uint64_t skips;
+    // loads中增量加载的次数
+    uint64_t deltas;
+    // 因为reload_burst被推迟的次数
+    uint64_t defer_rate;
+
+    // 下面按版本下标,index为当前版本
+    // refs为ref/unref(以及DDM_REF_CACHE的pin)的计数,不包括DDM_REF_EPOCH的读区间
+    // 非原子模式下是oop已经处理的计数,可能稍有滞后
+    int index;
+    int refs[DDM_MAX_VERSION_NUM];
+    // 计数从0变为非0后连续被持有的时间(毫秒),即最早的未释放ref的近似年龄
+    uint64_t hold_ms[DDM_MAX_VERSION_NUM];
+    // 非当前版本中最长的hold_ms,reload卡住时通常就是它
+    uint64_t stale_hold_ms;
+    // 等待空闲版本的reload已经推迟的时间(毫秒),0表示没有
+    uint64_t reload_wait_ms;
+};
+
+// ddm_reclaim_stat的结果
+struct ddm_reclaim_stat_t
+{
+    // 等待fini(包括正在fini)的版本数和size_fun得到的大小
+    uint64_t pending;
+    size_t pending_mem;
+    uint64_t reclaimed;
+    // fini_fun累计的耗时(毫秒)
+    uint64_t reclaim_ms;
+    // 最早的等待中的版本已经等待的时间(毫秒)
+    uint64_t oldest_ms;
+};
+
+#define DDM_PHASE_BUCKETS 16
+
+// ddm_reload_stat的结果
+struct ddm_reload_stat_t
+{
+    // 开始加载的reload次数,不包括首次加载
+    uint64_t started;
+    // 因为reload_burst被推迟的次数
+    uint64_t deferred;
+    // 一个reload_window_ms中开始的最多reload数(所有shard合计)
+    int max_burst;
+    // reload开始的时间按phase_period_ms取模后的分布
+    // 集中在少数几个桶中说明dd在同步reload
+    int phase_period_ms;
+    uint64_t phase[DDM_PHASE_BUCKETS];
+};
 
 struct dd_manager_t;
 
 struct dd_manager_t *ddm_ini(int max_num);
+struct dd_manager_t *ddm_ini_ex(const struct ddm_option_t *opt);
 void ddm_fini(struct dd_manager_t *ddm);
 
 // load dict: dict = ini_fun(ini_filename);
 // rem  dict: fini(dict);
-// 必须等待对应dd加载成功才返回(oop2dd)
+// 必须等待对应dd加载成功才返回
+// 控制队列满时不等待,返回DDM_OVERFLOW(ddm_del同理)
 int ddm_add(struct dd_manager_t *ddm, const char *name, int intval_s, void *(*ini_fun)(void *), void *ini_args, void (*fini_fun)(void *));
-// 必须等待对应dd删除成功才返回(oop2dd)
+// version_num不在[2, DDM_MAX_VERSION_NUM]之间返回DDM_OVERFLOW
+int ddm_add_ex(struct dd_manager_t *ddm, const char *name, void *(*ini_fun)(void *), void *ini_args, void (*fini_fun)(void *), const struct dd_option_t *opt);
+// 必须等待对应dd删除成功才返回
 int ddm_del(struct dd_manager_t *ddm, const char *name);
+// 内置的finger_fun,ini_args为文件路径
+// ddm_finger_file只比较stat(mtime/ctime/size/inode),ddm_finger_file_hash读取全部内容计算hash
+// 后者在文件被重写但内容不变时也能跳过,代价是每次reload读一遍文件
+int ddm_finger_file(void *path, uint64_t *finger);
+int ddm_finger_file_hash(void *path, uint64_t *finger);
+
+// 只读取计数,不等待oop,开销很小,可以由监控线程定期调用
+int ddm_stat(struct dd_manager_t *ddm, const char *name, struct dd_stat_t *stat);
+// 没有设置reclaim时返回DDM_UNIMPLEMENTED
+int ddm_reclaim_stat(struct dd_manager_t *ddm, struct ddm_reclaim_stat_t *stat);
+int ddm_reload_stat(struct dd_manager_t *ddm, struct ddm_reload_stat_t *stat);
 
 // 无需管理同步,只需在dd2oop中添加当前的dict即可
 // 不直接处理count
@@ -31,6 +213,48 @@ int ddm_del(struct dd_manager_t *ddm, const char *name);
 void *ddm_ref(struct dd_manager_t *ddm, const char *name);
 int ddm_unref(struct dd_manager_t *ddm, const char *name, void *dict);
 
+// 预先解析name得到的句柄,ref/unref时不再查找name,也不加ddm锁
+// ddm_del之后(即使槽位被重用)句柄失效,ddm_ref_h返回NULL
+struct dd_handle_t
+{
+    int slot;
+    uint32_t gen;
+};
+
+int ddm_handle(struct dd_manager_t *ddm, const char *name, struct dd_handle_t *handle);
+void *ddm_ref_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle);
+int ddm_unref_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle, void *dict);
+
+// name必须是以dd_kv_ini/dd_kv_fini添加的dd(dd_kv.h)
+// 查找key,把value(包括'\0')复制到val,*vlen为val的大小,返回时为value的长度
+// 没有dd或key返回DDM_NODICT,dd不是以dd_kv_fini添加的返回DDM_TYPE,val不够大返回DDM_OVERFLOW
+int ddm_get(struct dd_manager_t *ddm, const char *name, const char *key, size_t klen, char *val, size_t *vlen);
+int ddm_get_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle, const char *key, size_t klen, char *val, size_t *vlen);
+
+// group中的dd各自按intval_s加载,但新版本要等所有成员都加载完成后一起切换
+// 有成员在等待时,指纹(finger_fun)未变的成员,以及文件没有变化的watch模式(intval_s<=0)成员,以当前版本参与切换
+// ddm_ref_group一次得到所有成员同一次切换后的版本
+// 成员必须已经ddm_add完成,一个dd只能属于一个group,ddm_del会把dd移出group
+// 所有成员都ddm_del完成后group自动释放,之后可以用同一个名字重新ddm_group_add
+// 成员不在同一个shard时返回DDM_UNIMPLEMENTED
+int ddm_group_add(struct dd_manager_t *ddm, const char *group, const char **names, int num);
+// 返回成员数,dicts至少要有num个,按names的顺序,已删除的成员为NULL
+int ddm_ref_group(struct dd_manager_t *ddm, const char *group, void **dicts, int num);
+int ddm_unref_group(struct dd_manager_t *ddm, const char *group, void **dicts, int num);
+
+// DDM_REF_CACHE
+// 释放当前线程所有不在使用中的pin
+void ddm_cache_flush(struct dd_manager_t *ddm);
+
+// DDM_REF_EPOCH
+// ddm_read返回的dict只在当前读区间内有效,不需要unref
+// ddm_read需要查找name(ddm读锁),热路径使用ddm_read_h
+// 线程首次进入时占用一个读区间槽位,线程退出时归还,超过reader_num返回DDM_OVERFLOW
+int ddm_read_enter(struct dd_manager_t *ddm);
+void ddm_read_exit(struct dd_manager_t *ddm);
+void *ddm_read(struct dd_manager_t *ddm, const char *name);
+void *ddm_read_h(struct dd_manager_t *ddm, const struct dd_handle_t *handle);
+
 #ifdef __cplusplus
 }
 #endif
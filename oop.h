@@ -29,6 +29,10 @@ typedef enum {
 
 static const struct timeval OOP_TIME_NOW = { 0, 0 };
 
+/* Timeouts are measured on this clock (CLOCK_MONOTONIC), not gettimeofday(),
+   so that setting the system time does not fire or stall them. */
+void oop_gettime(struct timeval *tv);
+
 /* Maximum signal number.  (The OS may have a stricter limit!) */
 #define OOP_NUM_SIGNALS 	64
 
@@ -78,9 +82,22 @@ struct oop_source_t {
 #define oop_del(es)				((es)->del((es)))
 
 
-/* Create a system event source.  Returns NULL on failure. */
+/* Create a system event source.  Returns NULL on failure.
+   Signals are read from a signalfd polled like any other fd, with no
+   siglongjmp.  add_signal blocks the signal in the calling thread, which
+   must be the thread that runs the source (remove_signal restores it).
+   A process-directed signal that reaches another thread not blocking it
+   runs a handler that forwards it to that thread, so it is never lost to
+   the default action.  Only one source may watch a given signal. */
 oop_source_t *oop_sys_new();
 
+/* Wait with epoll(7) instead of select(): no FD_SETSIZE limit,
+   and dispatch only visits the ready file descriptors. */
+#define OOP_SYS_EPOLL		0x01
+
+/* Create a system event source with the above flags.  Returns NULL on failure. */
+oop_source_t *oop_sys_new_ex(int flags);
+
 
 #ifdef __cplusplus
 }
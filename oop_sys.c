@@ -13,9 +13,13 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <signal.h>
-#include <setjmp.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
 
 #ifdef HAVE_SYS_SELECT_H
 #include <sys/select.h>
@@ -35,6 +39,13 @@
 
 int _oop_continue, _oop_shortcut, _oop_error;
 
+void oop_gettime(struct timeval *tv) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	tv->tv_sec = ts.tv_sec;
+	tv->tv_usec = ts.tv_nsec / 1000;
+}
+
 static void *(*oop_malloc)(size_t) = malloc;
 static void (*oop_free)(void *) = free;
 /* static void *(*oop_realloc)(void *, size_t) = realloc; */
@@ -42,15 +53,24 @@ static void (*oop_free)(void *) = free;
 
 #define MAGIC 0x9643
 #define MAX_TIME_NODES	100
+#define MAX_EPOLL_EVENTS	256
+#define MIN_TIME_BUCKETS	64
+#define MIN_TIME_HEAP	64
 
 typedef struct sys_time sys_time;
 typedef struct sys_time_pool sys_time_pool;
 
+/* Pending timeouts live in a binary heap ordered by (tv, seq), and in a
+   hash table keyed by (tv, f, v) so that remove_time need not search.
+   Expired ones are moved to the time_run list; f is NULL once removed. */
 struct sys_time {
 	struct sys_time *next;
+	struct sys_time *hnext;
 	struct timeval tv;
 	oop_time_fun *f;
 	void *v;
+	unsigned long seq;
+	int pos; /* heap index, -1 on time_run */
 };
 
 struct sys_signal_handler {
@@ -62,7 +82,8 @@ struct sys_signal_handler {
 struct sys_signal {
 	struct sys_signal_handler *list,*ptr;
 	struct sigaction old;
-	volatile sig_atomic_t active;
+	int active;
+	int blocked; /* already blocked before add_signal */
 };
 
 struct sys_file_handler {
@@ -85,18 +106,26 @@ struct oop_source_sys {
 	int num_events;
 
 	/* Timeout queue */
-	struct sys_time *time_queue;
+	struct sys_time **time_heap;
+	int time_num;
+	int time_cap;
+	unsigned long time_seq;
+	struct sys_time **time_buckets;
+	unsigned time_mask;
+	unsigned time_hashed;
 	struct sys_time *time_run;
 
 	struct sys_time *time_empty;
 	sys_time_pool *time_pool;
 
-	/* Signal handling */
+	/* Signal handling, through a signalfd registered as a read fd */
 	struct sys_signal sig[OOP_NUM_SIGNALS];
-	sigjmp_buf env;
-	int do_jmp;
 	int sig_active;
 	int last_sig;
+	int sigfd;
+	int num_signals;
+	sigset_t sigmask;
+	pthread_t sig_thread; /* blocks the signals and reads the signalfd */
 
 	/* File descriptors */
 	int num_files;
@@ -104,6 +133,10 @@ struct oop_source_sys {
 	int last_read;
 	int last_write;
 	int last_exception;
+
+	/* epoll backend, -1 for select() */
+	int epfd;
+	struct epoll_event events[MAX_EPOLL_EVENTS];
 };
 
 struct oop_source_sys *sys_sig_owner[OOP_NUM_SIGNALS];
@@ -140,6 +173,35 @@ static oop_source_sys *verify_source(oop_source_t *source) {
 	return sys;
 }
 
+/* Sync the epoll interest set of fd with its registered handlers. */
+static void sys_epoll_update(oop_source_sys *sys,int fd,int had) {
+	struct epoll_event event;
+	memset(&event,0,sizeof(event));
+	if (NULL != sys->files[fd][OOP_READ].f) event.events |= EPOLLIN;
+	if (NULL != sys->files[fd][OOP_WRITE].f) event.events |= EPOLLOUT;
+	if (NULL != sys->files[fd][OOP_EXCEPTION].f) event.events |= EPOLLPRI;
+	event.data.fd = fd;
+
+	if (0 == event.events) {
+		/* The fd may already be closed, which removed it from the set. */
+		epoll_ctl(sys->epfd,EPOLL_CTL_DEL,fd,&event);
+		return;
+	}
+	if (0 != epoll_ctl(sys->epfd,had ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,fd,&event)) {
+		/* Closed and reopened under the same number, or vice versa. */
+		if (ENOENT == errno)
+			epoll_ctl(sys->epfd,EPOLL_CTL_ADD,fd,&event);
+		else if (EEXIST == errno)
+			epoll_ctl(sys->epfd,EPOLL_CTL_MOD,fd,&event);
+	}
+}
+
+static int sys_fd_registered(oop_source_sys *sys,int fd) {
+	return NULL != sys->files[fd][OOP_READ].f
+	||     NULL != sys->files[fd][OOP_WRITE].f
+	||     NULL != sys->files[fd][OOP_EXCEPTION].f;
+}
+
 static void sys_add_fd(oop_source_t *source,int fd,oop_event_t ev,
                       oop_fd_fun *f,void *v) {
 	oop_source_sys *sys = verify_source(source);
@@ -160,9 +222,11 @@ static void sys_add_fd(oop_source_t *source,int fd,oop_event_t ev,
 	}
 
 	assert(NULL == sys->files[fd][ev].f && "multiple handlers registered for a file event");
+	int had = sys_fd_registered(sys,fd);
 	sys->files[fd][ev].f = f;
 	sys->files[fd][ev].v = v;
 	++sys->num_events;
+	if (-1 != sys->epfd) sys_epoll_update(sys,fd,had);
 }
 
 static void sys_remove_fd(oop_source_t *source,int fd,oop_event_t ev) {
@@ -171,79 +235,185 @@ static void sys_remove_fd(oop_source_t *source,int fd,oop_event_t ev) {
 		sys->files[fd][ev].f = NULL;
 		sys->files[fd][ev].v = NULL;
 		--sys->num_events;
+		if (-1 != sys->epfd) sys_epoll_update(sys,fd,1);
 	}
 }
 
+static int tv_before(const struct timeval *a,const struct timeval *b) {
+	return a->tv_sec < b->tv_sec
+	||    (a->tv_sec == b->tv_sec && a->tv_usec < b->tv_usec);
+}
+
+/* Equal times fire in the order they were added. */
+static int time_before(const struct sys_time *a,const struct sys_time *b) {
+	if (a->tv.tv_sec != b->tv.tv_sec || a->tv.tv_usec != b->tv.tv_usec)
+		return tv_before(&a->tv,&b->tv);
+	return a->seq < b->seq;
+}
+
+static void heap_set(oop_source_sys *sys,int i,struct sys_time *time) {
+	sys->time_heap[i] = time;
+	time->pos = i;
+}
+
+static void heap_up(oop_source_sys *sys,int i) {
+	struct sys_time *time = sys->time_heap[i];
+	while (i > 0 && time_before(time,sys->time_heap[(i - 1) / 2])) {
+		heap_set(sys,i,sys->time_heap[(i - 1) / 2]);
+		i = (i - 1) / 2;
+	}
+	heap_set(sys,i,time);
+}
+
+static void heap_down(oop_source_sys *sys,int i) {
+	struct sys_time *time = sys->time_heap[i];
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= sys->time_num) break;
+		if (c + 1 < sys->time_num
+		&&  time_before(sys->time_heap[c + 1],sys->time_heap[c])) ++c;
+		if (!time_before(sys->time_heap[c],time)) break;
+		heap_set(sys,i,sys->time_heap[c]);
+		i = c;
+	}
+	heap_set(sys,i,time);
+}
+
+static void heap_remove(oop_source_sys *sys,struct sys_time *time) {
+	int i = time->pos;
+	struct sys_time *last = sys->time_heap[--sys->time_num];
+	time->pos = -1;
+	if (last == time) return;
+	heap_set(sys,i,last);
+	if (i > 0 && time_before(last,sys->time_heap[(i - 1) / 2]))
+		heap_up(sys,i);
+	else
+		heap_down(sys,i);
+}
+
+static unsigned time_hash(struct timeval tv,oop_time_fun *f,void *v) {
+	uint64_t h = (uint64_t)(uintptr_t)f * 0x9E3779B97F4A7C15ull;
+	h = (h ^ (uint64_t)(uintptr_t)v) * 0x9E3779B97F4A7C15ull;
+	h = (h ^ ((uint64_t)tv.tv_sec << 20 ^ (uint64_t)tv.tv_usec)) * 0x9E3779B97F4A7C15ull;
+	return (unsigned)(h >> 32);
+}
+
+static int hash_grow(oop_source_sys *sys) {
+	unsigned i,num = sys->time_mask + 1;
+	unsigned size = num * 2;
+	struct sys_time **buckets;
+	if (size < MIN_TIME_BUCKETS) size = MIN_TIME_BUCKETS;
+	buckets = (struct sys_time **)oop_malloc(size * sizeof(*buckets));
+	if (NULL == buckets) return -1;
+	memset(buckets,0,size * sizeof(*buckets));
+	for (i = 0; NULL != sys->time_buckets && i < num; ++i) {
+		struct sys_time *time = sys->time_buckets[i];
+		while (NULL != time) {
+			struct sys_time *next = time->hnext;
+			unsigned b = time_hash(time->tv,time->f,time->v) & (size - 1);
+			time->hnext = buckets[b];
+			buckets[b] = time;
+			time = next;
+		}
+	}
+	if (NULL != sys->time_buckets) oop_free(sys->time_buckets);
+	sys->time_buckets = buckets;
+	sys->time_mask = size - 1;
+	return 0;
+}
+
+static void hash_remove(oop_source_sys *sys,struct sys_time *time) {
+	struct sys_time **p = &sys->time_buckets[
+		time_hash(time->tv,time->f,time->v) & sys->time_mask];
+	while (*p != time) p = &(*p)->hnext;
+	*p = time->hnext;
+	--sys->time_hashed;
+}
+
 static void sys_add_time(oop_source_t *source,struct timeval tv,
                         oop_time_fun *f,void *v) {
 	oop_source_sys *sys = verify_source(source);
-	struct sys_time **p = &sys->time_queue;
-	struct sys_time *time = _time_node_new(sys);
+	struct sys_time *time;
+	unsigned b;
 	assert(tv.tv_usec >= 0 && "tv_usec must be positive");
 	assert(tv.tv_usec < 1000000 && "tv_usec measures microseconds");
 	assert(NULL != f && "callback must be non-NULL");
+
+	if (sys->time_num == sys->time_cap) {
+		int cap = sys->time_cap ? 2 * sys->time_cap : MIN_TIME_HEAP;
+		struct sys_time **heap = (struct sys_time **)oop_malloc(cap * sizeof(*heap));
+		if (NULL == heap) return; /* ugh */
+		if (0 != sys->time_num)
+			memcpy(heap,sys->time_heap,sys->time_num * sizeof(*heap));
+		if (NULL != sys->time_heap) oop_free(sys->time_heap);
+		sys->time_heap = heap;
+		sys->time_cap = cap;
+	}
+	if (sys->time_hashed >= sys->time_mask && 0 != hash_grow(sys))
+		return; /* ugh */
+
+	time = _time_node_new(sys);
 	if (NULL == time) return; /* ugh */
 	time->tv = tv;
 	time->f = f;
 	time->v = v;
+	time->seq = sys->time_seq++;
 
-	while (NULL != *p
-	&&    ((*p)->tv.tv_sec < tv.tv_sec
-	||    ((*p)->tv.tv_sec == tv.tv_sec 
-	&&     (*p)->tv.tv_usec <= tv.tv_usec))) p = &(*p)->next;
-	time->next = *p;
-	*p = time;
+	b = time_hash(tv,f,v) & sys->time_mask;
+	time->hnext = sys->time_buckets[b];
+	sys->time_buckets[b] = time;
+	++sys->time_hashed;
 
-	++sys->num_events;
-}
+	sys->time_heap[sys->time_num] = time;
+	heap_up(sys,sys->time_num++);
 
-static int sys_rm_time(oop_source_sys *sys,
-                           struct sys_time **p,struct timeval tv,
-                           oop_time_fun *f,void *v) {
-	while (NULL != *p
-	&&    ((*p)->tv.tv_sec < tv.tv_sec
-	||    ((*p)->tv.tv_sec == tv.tv_sec 
-	&&     (*p)->tv.tv_usec < tv.tv_usec))) p = &(*p)->next;
-	while (NULL != *p
-	&&     (*p)->tv.tv_sec == tv.tv_sec
-	&&     (*p)->tv.tv_usec == tv.tv_usec
-	&&    ((*p)->f != f || (*p)->v != v)) p = &(*p)->next;
-	if (NULL != *p 
-	&& (*p)->tv.tv_sec == tv.tv_sec && (*p)->tv.tv_usec == tv.tv_usec) {
-		struct sys_time *time = *p;
-		assert(f == time->f);
-		assert(v == time->v);
-		*p = time->next;
-		_time_node_free(sys, time);
-		--sys->num_events;
-		return 1;
-	}
-	return 0;
+	++sys->num_events;
 }
 
+/* Removes the earliest-added timeout matching (tv, f, v), like the list did. */
 static void sys_remove_time(oop_source_t *source,struct timeval tv,
                             oop_time_fun *f,void *v) {
 	oop_source_sys *sys = verify_source(source);
-	if (!sys_rm_time(sys,&sys->time_run,tv,f,v))
-		sys_rm_time(sys,&sys->time_queue,tv,f,v);
+	struct sys_time *p,*time = NULL;
+	if (NULL == sys->time_buckets) return;
+
+	p = sys->time_buckets[time_hash(tv,f,v) & sys->time_mask];
+	for (; NULL != p; p = p->hnext)
+		if (p->f == f && p->v == v
+		&&  p->tv.tv_sec == tv.tv_sec && p->tv.tv_usec == tv.tv_usec
+		&&  (NULL == time || p->seq < time->seq))
+			time = p;
+	if (NULL == time) return;
+
+	hash_remove(sys,time);
+	if (-1 != time->pos) {
+		heap_remove(sys,time);
+		_time_node_free(sys,time);
+	} else
+		time->f = NULL; /* on time_run, skipped and freed there */
+	--sys->num_events;
 }
 
+/* Other threads may not block the signal; a process-directed one then
+   lands here instead of the signalfd.  Forward it to the thread that
+   blocks it, where it shows up on the signalfd. */
 static void sys_signal_handler(int sig) {
 	oop_source_sys *sys = sys_sig_owner[sig];
-	struct sigaction act;
-	assert(NULL != sys);
-
-	/* Reset the handler, in case this is needed. */
-	sigaction(sig,NULL,&act);
-	act.sa_handler = sys_signal_handler;
-	sigaction(sig,&act,NULL);
-
-	assert(NULL != sys->sig[sig].list);
-	sys->sig[sig].active = 1;
-	sys->sig_active = 1;
+	if (NULL != sys) pthread_kill(sys->sig_thread,sig);
+}
 
-	/* Break out of select() loop, if necessary. */
-	if (sys->do_jmp) siglongjmp(sys->env,1);
+/* Only marks the signals; the handlers run after the file events. */
+static void *sys_signal_read(oop_source_t *source,int fd,oop_event_t ev,void *v) {
+	oop_source_sys *sys = verify_source(source);
+	struct signalfd_siginfo si;
+	while (sizeof(si) == read(fd,&si,sizeof(si))) {
+		int sig = si.ssi_signo;
+		if (sig > 0 && sig < OOP_NUM_SIGNALS && NULL != sys->sig[sig].list) {
+			sys->sig[sig].active = 1;
+			sys->sig_active = 1;
+		}
+	}
+	return OOP_CONTINUE;
 }
 
 static void sys_add_signal(oop_source_t *source,int sig,
@@ -255,27 +425,47 @@ static void sys_add_signal(oop_source_t *source,int sig,
 
 	assert(sig > 0 && sig < OOP_NUM_SIGNALS && "invalid signal number");
 
+	if (NULL == sys->sig[sig].list) {
+		sigset_t set,old;
+		sigemptyset(&set);
+		sigaddset(&set,sig);
+		sigaddset(&sys->sigmask,sig);
+
+		/* The signal must be blocked to be read from the signalfd. */
+		if (-1 == sys->sigfd) {
+			sys->sigfd = signalfd(-1,&sys->sigmask,SFD_NONBLOCK | SFD_CLOEXEC);
+			if (-1 == sys->sigfd) {
+				sigdelset(&sys->sigmask,sig);
+				oop_free(handler);
+				return; /* ugh */
+			}
+			sys_add_fd(source,sys->sigfd,OOP_READ,sys_signal_read,NULL);
+		} else
+			signalfd(sys->sigfd,&sys->sigmask,0);
+
+		pthread_sigmask(SIG_BLOCK,&set,&old);
+		sys->sig[sig].blocked = sigismember(&old,sig);
+		sys->sig_thread = pthread_self();
+		assert(0 == sys->sig[sig].active);
+		++sys->num_signals;
+
+		{
+			struct sigaction act;
+			assert(NULL == sys_sig_owner[sig]);
+			sys_sig_owner[sig] = sys;
+			memset(&act,0,sizeof(act));
+			act.sa_handler = sys_signal_handler;
+			act.sa_flags = SA_RESTART;
+			sigemptyset(&act.sa_mask);
+			sigaction(sig,&act,&sys->sig[sig].old);
+		}
+	}
+
 	handler->f = f;
 	handler->v = v;
 	handler->next = sys->sig[sig].list;
 	sys->sig[sig].list = handler;
 	++sys->num_events;
-
-	if (NULL == handler->next) {
-		struct sigaction act;
-
-		assert(NULL == sys_sig_owner[sig]);
-		sys_sig_owner[sig] = sys;
-
-		assert(0 == sys->sig[sig].active);
-		sigaction(sig,NULL,&act);
-		sys->sig[sig].old = act;
-		act.sa_handler = sys_signal_handler;
-#ifdef SA_NODEFER /* BSD/OS doesn't have this, for one. */
-		act.sa_flags &= ~SA_NODEFER;
-#endif
-		sigaction(sig,&act,NULL);
-	}
 }
 
 static void sys_remove_signal(oop_source_t *source,int sig,
@@ -293,8 +483,21 @@ static void sys_remove_signal(oop_source_t *source,int sig,
 
 		if (NULL == p->next && &sys->sig[sig].list == pp) {
 			sigaction(sig,&sys->sig[sig].old,NULL);
-			sys->sig[sig].active = 0;
 			sys_sig_owner[sig] = NULL;
+			sigdelset(&sys->sigmask,sig);
+			if (!sys->sig[sig].blocked) {
+				sigset_t set;
+				sigemptyset(&set);
+				sigaddset(&set,sig);
+				pthread_sigmask(SIG_UNBLOCK,&set,NULL);
+			}
+			sys->sig[sig].active = 0;
+			if (0 == --sys->num_signals) {
+				sys_remove_fd(source,sys->sigfd,OOP_READ);
+				close(sys->sigfd);
+				sys->sigfd = -1;
+			} else
+				signalfd(sys->sigfd,&sys->sigmask,0);
 		}
 
 		*pp = p->next;
@@ -309,16 +512,53 @@ static void *sys_time_run(oop_source_sys *sys) {
 	while (OOP_CONTINUE == ret && NULL != sys->time_run) {
 		struct sys_time *p = sys->time_run;
 		sys->time_run = sys->time_run->next;
-		--sys->num_events;
-		ret = p->f(&sys->oop,p->tv,p->v); /* reenter! */
+		if (NULL != p->f) {
+			hash_remove(sys,p);
+			--sys->num_events;
+			ret = p->f(&sys->oop,p->tv,p->v); /* reenter! */
+		}
 		_time_node_free(sys, p);
 	}
 	return ret;
 }
 
+/* Only the ready fds, O(ready) rather than O(num_files).
+   A callback may remove any fd, so look the handler up again each time. */
+static void *sys_epoll_dispatch(oop_source_sys *sys,int rv) {
+	void *ret = OOP_CONTINUE;
+	int k;
+	for (k = 0; OOP_CONTINUE == ret && k < rv; ++k) {
+		int fd = sys->events[k].data.fd;
+		uint32_t events = sys->events[k].events;
+		if (fd >= sys->num_files) continue;
+
+		if ((events & EPOLLPRI)
+		&&  NULL != sys->files[fd][OOP_EXCEPTION].f)
+			ret = sys->files[fd][OOP_EXCEPTION].f(
+				&sys->oop,fd,OOP_EXCEPTION,
+				 sys->files[fd][OOP_EXCEPTION].v);
+
+		/* select() reports errors and hangups as ready, too. */
+		if (OOP_CONTINUE == ret
+		&&  (events & (EPOLLOUT | EPOLLERR))
+		&&  NULL != sys->files[fd][OOP_WRITE].f)
+			ret = sys->files[fd][OOP_WRITE].f(
+				&sys->oop,fd,OOP_WRITE,
+				 sys->files[fd][OOP_WRITE].v);
+
+		if (OOP_CONTINUE == ret
+		&&  (events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+		&&  NULL != sys->files[fd][OOP_READ].f)
+			ret = sys->files[fd][OOP_READ].f(
+				&sys->oop,fd,OOP_READ,
+				 sys->files[fd][OOP_READ].v);
+	}
+	return ret;
+}
+
 static void *sys_run_once(oop_source_sys *sys, int nonblock) {
-	void * volatile ret = OOP_CONTINUE;
-	struct timeval * volatile ptv = NULL;
+	void *ret = OOP_CONTINUE;
+	struct timeval *ptv = NULL;
 	struct timeval tv;
 	fd_set rfd,wfd,xfd;
 	int i,rv;
@@ -332,22 +572,22 @@ static void *sys_run_once(oop_source_sys *sys, int nonblock) {
 		ptv = &tv;
 		tv.tv_sec = 0;
 		tv.tv_usec = 0;
-	} else if (NULL != sys->time_queue) {
+	} else if (0 != sys->time_num) {
+		struct sys_time *first = sys->time_heap[0];
 		ptv = &tv;
-		gettimeofday(ptv,NULL);
-		if (sys->time_queue->tv.tv_usec < tv.tv_usec) {
+		oop_gettime(ptv);
+		if (first->tv.tv_usec < tv.tv_usec) {
 			tv.tv_usec -= 1000000;
 			tv.tv_sec ++;
 		}
-		tv.tv_sec = sys->time_queue->tv.tv_sec - tv.tv_sec;
-		tv.tv_usec = sys->time_queue->tv.tv_usec - tv.tv_usec;
+		tv.tv_sec = first->tv.tv_sec - tv.tv_sec;
+		tv.tv_usec = first->tv.tv_usec - tv.tv_usec;
 		if (tv.tv_sec < 0) {
 			tv.tv_sec = 0;
 			tv.tv_usec = 0;
 		}
 	}
 
-	if (!sys->sig_active) sys->do_jmp = !sigsetjmp(sys->env,1);
 	if (sys->sig_active) {
 		/* Still perform select(), but don't block. */
 		ptv = &tv;
@@ -363,55 +603,43 @@ static void *sys_run_once(oop_source_sys *sys, int nonblock) {
 	   || (ptv->tv_sec >= 0 && ptv->tv_sec < 3600
            &&  ptv->tv_usec >= 0 && ptv->tv_usec < 1000000));
 
-	FD_ZERO(&rfd);
-	FD_ZERO(&wfd);
-	FD_ZERO(&xfd);
-	for (i = 0; i < sys->num_files; ++i) {
-		if (NULL != sys->files[i][OOP_READ].f) FD_SET(i,&rfd);
-		if (NULL != sys->files[i][OOP_WRITE].f) FD_SET(i,&wfd);
-		if (NULL != sys->files[i][OOP_EXCEPTION].f) FD_SET(i,&xfd);
-	}
-
-	do
-		rv = select(sys->num_files,&rfd,&wfd,&xfd,ptv);
-	while (0 > rv && EINTR == errno);
+	if (-1 != sys->epfd) {
+		/* Round up, so that the timers are due when we wake. */
+		int timeout = -1;
+		if (NULL != ptv)
+			timeout = ptv->tv_sec * 1000 + (ptv->tv_usec + 999) / 1000;
+		do
+			rv = epoll_wait(sys->epfd,sys->events,MAX_EPOLL_EVENTS,timeout);
+		while (0 > rv && EINTR == errno);
+	} else {
+		FD_ZERO(&rfd);
+		FD_ZERO(&wfd);
+		FD_ZERO(&xfd);
+		for (i = 0; i < sys->num_files; ++i) {
+			if (NULL != sys->files[i][OOP_READ].f) FD_SET(i,&rfd);
+			if (NULL != sys->files[i][OOP_WRITE].f) FD_SET(i,&wfd);
+			if (NULL != sys->files[i][OOP_EXCEPTION].f) FD_SET(i,&xfd);
+		}
 
-	sys->do_jmp = 0;
+		do
+			rv = select(sys->num_files,&rfd,&wfd,&xfd,ptv);
+		while (0 > rv && EINTR == errno);
+	}
 
 	if (0 > rv) { /* Error in select(). */
-		fprintf(stderr, "select() failed: %s\n", strerror(errno));
+		fprintf(stderr, "%s failed: %s\n",
+			-1 != sys->epfd ? "epoll_wait()" : "select()", strerror(errno));
 		ret = OOP_ERROR;
 		goto done; 
 	}
 
-	if (sys->sig_active)
+	if (0 < rv && -1 != sys->epfd)
 	{
-		sys->sig_active = 0;
-		last = sys->last_sig + 1;
-		for (k = 0; OOP_CONTINUE == ret && k < OOP_NUM_SIGNALS; ++k)
-		{
-			i = (k + last) % OOP_NUM_SIGNALS;
-			if (sys->sig[i].active) {
-				sys->sig[i].active = 0;
-				sys->sig[i].ptr = sys->sig[i].list;
-			}
-			while (OOP_CONTINUE == ret && NULL != sys->sig[i].ptr) {
-				struct sys_signal_handler *h;
-				h = sys->sig[i].ptr;
-				sys->sig[i].ptr = h->next;
-				ret = h->f(&sys->oop,i,h->v);
-			}
-		}
-		sys->last_sig = i;
-		if (OOP_CONTINUE != ret)
-		{
-			sys->sig_active = 1; /* come back */
-			if (OOP_SHORTCUT != ret)
-				goto done;
-		}
+		ret = sys_epoll_dispatch(sys,rv);
+		if (OOP_CONTINUE != ret && OOP_SHORTCUT != ret)
+			goto done;
 	}
-
-	if (0 < rv)
+	else if (0 < rv)
 	{
 		last = sys->last_exception + 1;
 		for (k = 0; OOP_CONTINUE == ret && k < sys->num_files; ++k)
@@ -453,24 +681,51 @@ static void *sys_run_once(oop_source_sys *sys, int nonblock) {
 			goto done;
 	}
 
+	/* Signals read from the signalfd above, or left over. */
+	if (sys->sig_active)
+	{
+		sys->sig_active = 0;
+		last = sys->last_sig + 1;
+		for (k = 0; OOP_CONTINUE == ret && k < OOP_NUM_SIGNALS; ++k)
+		{
+			i = (k + last) % OOP_NUM_SIGNALS;
+			if (sys->sig[i].active) {
+				sys->sig[i].active = 0;
+				sys->sig[i].ptr = sys->sig[i].list;
+			}
+			while (OOP_CONTINUE == ret && NULL != sys->sig[i].ptr) {
+				struct sys_signal_handler *h;
+				h = sys->sig[i].ptr;
+				sys->sig[i].ptr = h->next;
+				ret = h->f(&sys->oop,i,h->v);
+			}
+		}
+		sys->last_sig = i;
+		if (OOP_CONTINUE != ret)
+		{
+			sys->sig_active = 1; /* come back */
+			if (OOP_SHORTCUT != ret)
+				goto done;
+		}
+	}
+
 	/* Catch any leftover timeout events. */
 	ret = sys_time_run(sys);
 	if (OOP_CONTINUE != ret)
 		goto done;
 
-	if (NULL != sys->time_queue)
+	if (0 != sys->time_num)
 	{
-		struct sys_time *p,**pp = &sys->time_queue;
-		gettimeofday(&tv,NULL);
-		while (NULL != *pp 
-		   && (tv.tv_sec > (*pp)->tv.tv_sec
-		   || (tv.tv_sec == (*pp)->tv.tv_sec
-		   &&  tv.tv_usec >= (*pp)->tv.tv_usec)))
-			pp = &(*pp)->next;
-		p = *pp;
-		*pp = NULL;
-		sys->time_run = sys->time_queue;
-		sys->time_queue = p;
+		/* Timeouts added by the callbacks below wait for the next turn. */
+		struct sys_time **pp = &sys->time_run;
+		oop_gettime(&tv);
+		while (0 != sys->time_num && !tv_before(&tv,&sys->time_heap[0]->tv)) {
+			struct sys_time *p = sys->time_heap[0];
+			heap_remove(sys,p);
+			p->next = NULL;
+			*pp = p;
+			pp = &p->next;
+		}
 	}
 
 	ret = sys_time_run(sys);
@@ -503,7 +758,7 @@ static void sys_delete(oop_source_t *source) {
 	sys_time_pool *pool, *tmp_pool;
 	oop_source_sys *sys = verify_source(source);
 	assert(!sys->in_run && "cannot delete while in oop_sys_run");
-	assert(NULL == sys->time_queue 
+	assert(0 == sys->time_num
 	&&     NULL == sys->time_run
 	&&     "cannot delete with timeout");
 
@@ -515,7 +770,10 @@ static void sys_delete(oop_source_t *source) {
 			assert(NULL == sys->files[i][j].f && "cannot delete with file handler");
 
 	assert(0 == sys->num_events);
+	if (-1 != sys->epfd) close(sys->epfd);
 	if (NULL != sys->files) oop_free(sys->files);
+	if (NULL != sys->time_heap) oop_free(sys->time_heap);
+	if (NULL != sys->time_buckets) oop_free(sys->time_buckets);
 	pool = sys->time_pool;
 	while(pool){
 		tmp_pool = pool;
@@ -525,7 +783,7 @@ static void sys_delete(oop_source_t *source) {
 	oop_free(sys);
 }
 
-oop_source_t *oop_sys_new(void)
+static oop_source_sys *sys_new(void)
 {
 	int i;
 	oop_source_sys *source = (oop_source_sys *)oop_malloc(sizeof(oop_source_sys));
@@ -544,19 +802,52 @@ oop_source_t *oop_sys_new(void)
 	source->magic = MAGIC;
 	source->in_run = 0;
 	source->num_events = 0;
-	source->time_queue = source->time_run = NULL;
+	source->time_heap = NULL;
+	source->time_num = source->time_cap = 0;
+	source->time_seq = 0;
+	source->time_buckets = NULL;
+	source->time_mask = 0;
+	source->time_hashed = 0;
+	source->time_run = NULL;
 
-	source->do_jmp = 0;
 	source->sig_active = 0;
+	source->sigfd = -1;
+	source->num_signals = 0;
+	sigemptyset(&source->sigmask);
 	for (i = 0; i < OOP_NUM_SIGNALS; ++i) {
 		source->sig[i].list = NULL;
 		source->sig[i].ptr = NULL;
 		source->sig[i].active = 0;
+		source->sig[i].blocked = 0;
 	}
 
 	source->num_files = 0;
 	source->files = NULL;
+	source->epfd = -1;
+
+	return source;
+}
+
+oop_source_t *oop_sys_new(void)
+{
+	oop_source_sys *source = sys_new();
+	if (NULL == source)
+		return NULL;
+	return &source->oop;
+}
 
+oop_source_t *oop_sys_new_ex(int flags)
+{
+	oop_source_sys *source = sys_new();
+	if (NULL == source)
+		return NULL;
+	if (flags & OOP_SYS_EPOLL) {
+		source->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (-1 == source->epfd) {
+			oop_free(source);
+			return NULL;
+		}
+	}
 	return &source->oop;
 }
 
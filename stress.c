@@ -0,0 +1,445 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "dyndict_manager.h"
+
+// 多线程ref/unref/reload/add/del,检查每个加载的版本都正好fini一次,使用中的版本没有被fini
+// 以及ddm_ref_group得到的成员版本是同一次切换的
+// 每种ref模式(队列,DDM_REF_ATOMIC,DDM_REF_EPOCH,DDM_REF_CACHE)分别用单个shard和多个shard加loader运行
+// 多个shard时再用DDM_EPOLL运行一次
+// make tsan/make asan用sanitizer编译后运行
+//
+// stress [ms]   每种情况运行的毫秒数,默认500
+
+#define MAGIC 0x5354524E
+#define DEAD 0x44454144
+
+#define READER_NUM 4
+#define WATCH_NUM 4
+#define CHURN_NUM 4
+#define NAME_NUM (WATCH_NUM + CHURN_NUM)
+// 从PAIR开始的watch dd组成group,都加载paths[PAIR]
+#define PAIR 2
+
+struct dict_t
+{
+    int magic;
+    int id;
+    // group成员加载时文件中的轮次
+    int round;
+};
+
+static int loads;
+static int finis;
+static int stop;
+static int finied;
+static int flags;
+static char names[NAME_NUM][16];
+static char paths[WATCH_NUM][64];
+// group中数据源不变化的成员
+static char still[64];
+
+static void *ini(void *args)
+{
+    struct dict_t *d = (struct dict_t *)malloc(sizeof (struct dict_t));
+    d->magic = MAGIC;
+    d->id = __atomic_add_fetch(&loads, 1, __ATOMIC_RELAXED);
+    d->round = 0;
+
+    return d;
+}
+
+static void *pair_ini(void *args)
+{
+    struct dict_t *d = (struct dict_t *)ini(args);
+    int fd = open((const char *)args, O_RDONLY);
+    if (fd != -1)
+    {
+        if (read(fd, &d->round, sizeof (d->round)) != sizeof (d->round))
+            d->round = 0;
+        close(fd);
+    }
+
+    return d;
+}
+
+static void fini(void *args)
+{
+    struct dict_t *d = (struct dict_t *)args;
+    if (d->magic != MAGIC)
+        abort();
+    d->magic = DEAD;
+    __atomic_add_fetch(&finis, 1, __ATOMIC_RELAXED);
+    free(d);
+}
+
+// 版本在ref和unref之间不能被fini
+static void use(void *dict)
+{
+    struct dict_t *d = (struct dict_t *)dict;
+    if (d != NULL && __atomic_load_n(&d->magic, __ATOMIC_RELAXED) != MAGIC)
+    {
+        fprintf(stderr, "dict %d used after fini\n", d->id);
+        abort();
+    }
+}
+
+// 返回成员的轮次,成员来自不同的切换时abort
+static int pair_round(struct dd_manager_t *ddm)
+{
+    void *dicts[WATCH_NUM - PAIR];
+    if (ddm_ref_group(ddm, "pair", dicts, WATCH_NUM - PAIR) != WATCH_NUM - PAIR)
+        abort();
+
+    int round = ((struct dict_t *)dicts[0])->round;
+    int i;
+    for (i = 0; i < WATCH_NUM - PAIR; i++)
+    {
+        use(dicts[i]);
+        if (((struct dict_t *)dicts[i])->round != round)
+        {
+            fprintf(stderr, "group round %d and %d\n", round, ((struct dict_t *)dicts[i])->round);
+            abort();
+        }
+    }
+    ddm_unref_group(ddm, "pair", dicts, WATCH_NUM - PAIR);
+
+    return round;
+}
+
+static void *reader(void *args)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)args;
+    unsigned int seed = (unsigned int)(uintptr_t)&seed;
+    long n = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        const char *name = names[rand_r(&seed) % NAME_NUM];
+        void *d = ddm_ref(ddm, name);
+        use(d);
+        if (rand_r(&seed) % 64 == 0)
+            usleep(100);
+        use(d);
+        if (d != NULL)
+            ddm_unref(ddm, name, d);
+
+        // 句柄在del之后失效,ref_h返回NULL
+        struct dd_handle_t handle;
+        if (ddm_handle(ddm, name, &handle) == DDM_OK)
+        {
+            d = ddm_ref_h(ddm, &handle);
+            use(d);
+            if (d != NULL)
+                ddm_unref_h(ddm, &handle, d);
+        }
+
+        if (flags & DDM_REF_EPOCH)
+        {
+            ddm_read_enter(ddm);
+            use(ddm_read(ddm, name));
+            ddm_read_exit(ddm);
+        }
+
+        pair_round(ddm);
+        // churn的dd各自组成一个group,可能正在删除
+        void *dict;
+        if (ddm_ref_group(ddm, name, &dict, 1) == 1)
+        {
+            use(dict);
+            ddm_unref_group(ddm, name, &dict, 1);
+        }
+        if ((flags & DDM_REF_CACHE) && n % 1024 == 0)
+            ddm_cache_flush(ddm);
+        n++;
+    }
+
+    // pin在线程退出时释放
+    return (void *)n;
+}
+
+// DDM_REF_CACHE下pin住所有dd之后不再ref,ddm_fini之后才退出
+// 它的pin只能由推迟的reload,ddm_del和ddm_fini取走
+static void *idle(void *args)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)args;
+    int i;
+    for (i = 0; i < NAME_NUM; i++)
+    {
+        void *d = ddm_ref(ddm, names[i]);
+        if (d != NULL)
+            ddm_unref(ddm, names[i], d);
+    }
+    while (!__atomic_load_n(&finied, __ATOMIC_ACQUIRE))
+        usleep(1000);
+
+    return NULL;
+}
+
+static void rewrite(const char *path, int i)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd != -1)
+    {
+        write(fd, &i, sizeof (i));
+        close(fd);
+    }
+}
+
+// 不断改写watch的文件,触发reload
+static void *writer(void *args)
+{
+    int i = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        rewrite(paths[i % PAIR], i);
+        i++;
+        usleep(500);
+    }
+
+    return NULL;
+}
+
+// 每一轮用rename替换group的文件,所有成员一起切换到这一轮之后才开始下一轮
+static void *pair_writer(void *args)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)args;
+    char tmp[72];
+    snprintf(tmp, sizeof (tmp), "%s.tmp", paths[PAIR]);
+    int round = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        round++;
+        rewrite(tmp, round);
+        rename(tmp, paths[PAIR]);
+
+        int i;
+        for (i = 0; pair_round(ddm) != round; i++)
+        {
+            if (i == 5000)
+            {
+                fprintf(stderr, "group round %d not published\n", round);
+                abort();
+            }
+            usleep(1000);
+        }
+    }
+
+    return NULL;
+}
+
+// 反复add/del,槽位和gen被不断重用
+// 每个dd组成只有它自己的group,del之后group释放,下一次可以用同一个名字再次ddm_group_add
+static void *churn(void *args)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)args;
+    int i = 0;
+    while (!__atomic_load_n(&stop, __ATOMIC_RELAXED))
+    {
+        const char *name = names[WATCH_NUM + i % CHURN_NUM];
+        if (ddm_add(ddm, name, 1, ini, NULL, fini) == DDM_OK)
+        {
+            if (ddm_group_add(ddm, name, &name, 1) != DDM_OK)
+                abort();
+            usleep(200);
+            if (ddm_del(ddm, name) != DDM_OK)
+                abort();
+        }
+        i++;
+    }
+
+    return NULL;
+}
+
+static int run(int ref_flags, int shard_num, int loader_num, int ms)
+{
+    struct ddm_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.flags = ref_flags;
+    opt.max_num = NAME_NUM;
+    opt.shard_num = shard_num;
+    opt.loader_num = loader_num;
+    opt.reclaim = loader_num > 0;
+    struct dd_manager_t *ddm = ddm_ini_ex(&opt);
+    if (ddm == NULL)
+        return 1;
+
+    flags = ref_flags;
+    loads = 0;
+    finis = 0;
+    stop = 0;
+    finied = 0;
+
+    int i;
+    for (i = 0; i < WATCH_NUM; i++)
+    {
+        struct dd_option_t dopt;
+        memset(&dopt, 0, sizeof (dopt));
+        dopt.debounce_ms = 1;
+        dopt.version_num = 2 + i % 3;
+        if (i < PAIR)
+        {
+            dopt.watch_path = paths[i];
+            if (ddm_add_ex(ddm, names[i], ini, paths[i], fini, &dopt) != DDM_OK)
+                return 1;
+        }
+        else
+        {
+            // group的成员必须在同一个shard
+            dopt.watch_path = paths[PAIR];
+            dopt.shard = 1;
+            if (ddm_add_ex(ddm, names[i], pair_ini, paths[PAIR], fini, &dopt) != DDM_OK)
+                return 1;
+        }
+    }
+    const char *pair[WATCH_NUM - PAIR];
+    for (i = PAIR; i < WATCH_NUM; i++)
+        pair[i - PAIR] = names[i];
+    if (ddm_group_add(ddm, "pair", pair, WATCH_NUM - PAIR) != DDM_OK)
+        return 1;
+
+    pthread_t readers[READER_NUM];
+    pthread_t writer_pid;
+    pthread_t pair_pid;
+    pthread_t churn_pid;
+    pthread_t idle_pid;
+    if (flags & DDM_REF_CACHE)
+        pthread_create(&idle_pid, NULL, idle, ddm);
+    for (i = 0; i < READER_NUM; i++)
+        pthread_create(&readers[i], NULL, reader, ddm);
+    pthread_create(&writer_pid, NULL, writer, NULL);
+    pthread_create(&pair_pid, NULL, pair_writer, ddm);
+    pthread_create(&churn_pid, NULL, churn, ddm);
+
+    usleep(ms * 1000);
+    __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+
+    long refs = 0;
+    for (i = 0; i < READER_NUM; i++)
+    {
+        void *n;
+        pthread_join(readers[i], &n);
+        refs += (long)n;
+    }
+    pthread_join(writer_pid, NULL);
+    pthread_join(pair_pid, NULL);
+    pthread_join(churn_pid, NULL);
+
+    // 一半(包括group的一个成员)在fini之前删除,另一半由ddm_fini删除
+    for (i = 1; i <= WATCH_NUM / 2; i++)
+    {
+        if (ddm_del(ddm, names[i]) != DDM_OK)
+            return 1;
+    }
+    ddm_fini(ddm);
+    if (flags & DDM_REF_CACHE)
+    {
+        __atomic_store_n(&finied, 1, __ATOMIC_RELEASE);
+        pthread_join(idle_pid, NULL);
+    }
+
+    printf("flags %d shards %d loaders %d: refs %ld loads %d finis %d\n",
+            ref_flags, shard_num, loader_num, refs, loads, finis);
+
+    return loads != finis || loads <= NAME_NUM;
+}
+
+static int group_id(struct dd_manager_t *ddm)
+{
+    void *dicts[2];
+    if (ddm_ref_group(ddm, "group", dicts, 2) != 2)
+        return -1;
+    int id = ((struct dict_t *)dicts[0])->id;
+    ddm_unref_group(ddm, "group", dicts, 2);
+
+    return id;
+}
+
+// group中只有一个成员的数据源变化,它的新版本也要能切换出去
+// still_opt是数据源不变化的成员的选项
+static int run_group(const char *desc, const struct dd_option_t *still_opt)
+{
+    struct dd_manager_t *ddm = ddm_ini(2);
+    if (ddm == NULL)
+        return 1;
+
+    loads = 0;
+    finis = 0;
+
+    struct dd_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.watch_path = paths[0];
+    opt.debounce_ms = 1;
+    const char *members[] = {"changed", "still"};
+    if (ddm_add_ex(ddm, members[0], ini, paths[0], fini, &opt) != DDM_OK
+            || ddm_add_ex(ddm, members[1], ini, still, fini, still_opt) != DDM_OK
+            || ddm_group_add(ddm, "group", members, 2) != DDM_OK)
+        return 1;
+
+    int first = group_id(ddm);
+    rewrite(paths[0], 0);
+    // 定时的成员每秒检查一次
+    int id = first;
+    int i;
+    for (i = 0; i < 300 && id == first; i++)
+    {
+        usleep(10000);
+        id = group_id(ddm);
+    }
+    ddm_fini(ddm);
+
+    printf("group %s: loads %d finis %d%s\n", desc, loads, finis, id == first ? ", not published" : "");
+
+    return id == first || loads != finis;
+}
+
+int main(int argc, char *argv[])
+{
+    int ms = argc > 1 ? atoi(argv[1]) : 500;
+
+    char dir[] = "/tmp/ddm_stressXXXXXX";
+    if (mkdtemp(dir) == NULL)
+        return 1;
+
+    int i;
+    for (i = 0; i < NAME_NUM; i++)
+        snprintf(names[i], sizeof (names[i]), "%s%d", i < WATCH_NUM ? "watch" : "churn", i);
+    for (i = 0; i < WATCH_NUM; i++)
+    {
+        snprintf(paths[i], sizeof (paths[i]), "%s/%d", dir, i);
+        close(open(paths[i], O_WRONLY | O_CREAT, 0644));
+    }
+    snprintf(still, sizeof (still), "%s/still", dir);
+    close(open(still, O_WRONLY | O_CREAT, 0644));
+
+    int modes[] = {0, DDM_REF_ATOMIC, DDM_REF_EPOCH, DDM_REF_CACHE};
+    int ret = 0;
+    for (i = 0; i < (int)(sizeof (modes) / sizeof (modes[0])); i++)
+    {
+        ret |= run(modes[i], 1, 0, ms);
+        ret |= run(modes[i], 2, 2, ms);
+        ret |= run(modes[i] | DDM_EPOLL, 2, 2, ms);
+    }
+
+    struct dd_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.intval_s = 1;
+    opt.finger_fun = ddm_finger_file;
+    ret |= run_group("finger", &opt);
+    memset(&opt, 0, sizeof (opt));
+    opt.watch_path = still;
+    opt.debounce_ms = 1;
+    ret |= run_group("watch", &opt);
+
+    for (i = 0; i < WATCH_NUM; i++)
+        unlink(paths[i]);
+    unlink(still);
+    rmdir(dir);
+
+    printf("%s\n", ret == 0 ? "ok" : "FAILED");
+
+    return ret;
+}
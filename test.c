@@ -50,15 +50,37 @@ void *another_thread(void *args)
     return NULL;
 }
 
+// watch模式,只在sample.dict改变后才会打印新的内容
+void *watch_thread(void *args)
+{
+    struct dd_manager_t *ddm = (struct dd_manager_t *)args;
+    while (1)
+    {
+        struct dict_t *d = ddm_ref(ddm, "test3");
+        printf("3 => %s\n", d->str);
+        sleep(3);
+        ddm_unref(ddm, "test3", d);
+    }
+
+    return NULL;
+}
+
 int main()
 {
     struct dd_manager_t *ddm = ddm_ini(100);
 
     ddm_add(ddm, "test", 1, ini, "sample.dict", fini);
     ddm_add(ddm, "test2", 1, ini, "sample.dict", fini);
+    // test.sh改写sample.dict后才重新加载
+    struct dd_option_t opt;
+    memset(&opt, 0, sizeof (opt));
+    opt.watch_path = "sample.dict";
+    ddm_add_ex(ddm, "test3", ini, "sample.dict", fini, &opt);
 
     pthread_t pid;
     pthread_create(&pid, NULL, another_thread, ddm);
+    pthread_t watch_pid;
+    pthread_create(&watch_pid, NULL, watch_thread, ddm);
 
     while (1)
     {